@@ -17,8 +17,18 @@
 #include "command.h"
 #include "progressbar.h"
 #include "image.h"
-#include "algo/threaded_loop.h"
+#include "algo/loop.h"
 #include "math/constrained_least_squares.h"
+#include "alloc_stats.h"
+#include "huge_pages.h"
+#include "memory_plan.h"
+#include "parallel_gzip.h"
+#include "thread_pool.h"
+#include "tiled_loop.h"
+#include "timings.h"
+#include "trace.h"
+
+#include <mutex>
 
 using namespace MR;
 using namespace App;
@@ -55,7 +65,38 @@ void usage ()
     +   Argument ("value").type_float (0.0)
 
     + Option ("prediction", "output predicted image")
-    +   Argument ("image").type_image_out();
+    +   Argument ("image").type_image_out()
+
+    + Option ("memory_limit", "set an approximate upper limit (in MB) on the memory used. The fit is performed voxel by voxel "
+                              "over memory-mapped images, so that only compressed images (which are held in memory in their entirety) "
+                              "and the solver workspace of each thread require memory; if the estimated peak memory use exceeds "
+                              "this limit, the command fails before loading any data. (default: no limit)")
+    +   Argument ("MB").type_integer (1)
+
+    + Option ("dry_run", "report the estimated peak memory use and run time, without loading any data or performing the fit.")
+
+    + Option ("pin_threads", "pin each thread to its own core, and place the pages of compressed output images (held in memory) "
+                             "on the NUMA node of the thread that processes them, which reduces the memory traffic between sockets "
+                             "on multi-socket systems. (default: as set by the ThreadAffinity config entry)")
+
+    + Option ("huge_pages", "back the images (where held in memory, or where the filesystem supports it for memory-mapped images) "
+                            "with transparent huge pages, which reduces the TLB misses incurred by the pass over large images (as reported "
+                            "by the -perf_counters option); normal pages are used if huge pages are unavailable, as reported at -info. "
+                            "(default: as set by the HugePages config entry)")
+
+    + Option ("timings", "report the wall-clock and CPU time spent in each phase of the command (loading and fit).")
+
+    + Option ("timings_file", "write the timings of the -timings option to file, in JSON format.")
+    +   Argument ("file").type_file_out()
+
+    + Option ("perf_counters", "also record the hardware performance counters (CPU cycles, instructions, last-level cache misses, "
+                               "branch misses and data TLB misses) of each phase, summed over all threads (and per thread in the file of the "
+                               "-timings_file option); implies -timings unless -timings_file is provided. This requires "
+                               "access to the perf_event interface of the Linux kernel; if unavailable, only the timings are reported.")
+
+    + Option ("trace", "record a timeline of the phases and parallel loops executed by each thread, written to file "
+                       "in Chrome trace-event format (for viewing in chrome://tracing or Perfetto).")
+    +   Argument ("file").type_file_out();
 }
 
 
@@ -64,29 +105,63 @@ void usage ()
 using value_type = float;
 using compute_type = double;
 
+// Nominal per-thread costs used to estimate the run time (its order of magnitude only)
+#define PLAN_NS_PER_MULTIPLY_ADD 1.0
+#define PLAN_READ_MB_PER_SECOND 500.0
+
+// Solver statistics over all voxels: each copy of the Processor counts its own voxels and
+// iterations, and adds these to the shared totals on destruction
+struct FitStatistics { NOMEMALIGN
+  FitStatistics () : voxels (0), iterations (0), not_converged (0) { }
+  size_t voxels, iterations, not_converged;
+  std::mutex mutex;
+};
+
 class Processor {
   public:
-    Processor (const Math::ICLS::Problem<compute_type>& problem, Image<value_type>& prediction) :
+    Processor (const Math::ICLS::Problem<compute_type>& problem, Image<value_type>& prediction, FitStatistics& statistics) :
       solve (problem),
       x(problem.H.cols()),
       b(problem.H.rows()),
-      prediction (prediction) { }
+      prediction (prediction),
+      statistics (statistics),
+      voxels (0), iterations (0), not_converged (0) { }
+
+    Processor (const Processor& that) :
+      solve (that.solve),
+      x (that.x),
+      b (that.b),
+      prediction (that.prediction),
+      statistics (that.statistics),
+      voxels (0), iterations (0), not_converged (0) { }
+
+    ~Processor () {
+      std::lock_guard<std::mutex> lock (statistics.mutex);
+      statistics.voxels += voxels;
+      statistics.iterations += iterations;
+      statistics.not_converged += not_converged;
+    }
 
     void operator() (Image<value_type>& in, Image<value_type>& out)
     {
+      AllocStats::HotRegion hot ("Processor");
       for (auto l = Loop (3) (in); l; ++l)
         b[in.index(3)] = in.value();
 
       auto niter = solve (x, b);
-      if (niter >= solve.problem().max_niter)
+      ++voxels;
+      iterations += niter;
+      if (niter >= solve.problem().max_niter) {
+        ++not_converged;
         INFO ("voxel at [ " + str(in.index(0)) + " " + str(in.index(1)) + " " + str(in.index(2)) + " ] failed to converge");
+      }
 
       for (auto l = Loop (3) (out); l; ++l)
         out.value() = x[out.index(3)];
 
       if (prediction.valid()) {
         assign_pos_of (in, 0, 3).to (prediction);
-        b = solve.problem().H * x;
+        b.noalias() = solve.problem().H * x;
         for (auto l = Loop (3) (prediction); l; ++l)
           prediction.value() = b[prediction.index(3)];
       }
@@ -95,10 +170,25 @@ class Processor {
     Math::ICLS::Solver<compute_type> solve;
     Eigen::VectorXd x, b;
     Image<value_type> prediction;
+    FitStatistics& statistics;
+    size_t voxels, iterations, not_converged;
 };
 
 void run ()
 {
+  if (get_options ("pin_threads").size())
+    ThreadPool::pin_threads (true);
+  if (get_options ("huge_pages").size())
+    HugePages::request (true);
+  auto opt = get_options ("trace");
+  if (opt.size())
+    Trace::enable (opt[0][0]);
+  opt = get_options ("timings_file");
+  const bool perf_counters = get_options ("perf_counters").size();
+  if (get_options ("timings").size() || opt.size() || perf_counters)
+    Timings::enable (get_options ("timings").size() || (perf_counters && opt.empty()),
+                     opt.size() ? std::string (opt[0][0]) : std::string(), perf_counters);
+
   auto max_iterations      = get_option_value ("niter",           0  );
   auto tolerance           = get_option_value ("tolerance",       0.0);
   auto solution_norm_reg   = get_option_value ("solution_norm",   0.0);
@@ -107,7 +197,7 @@ void run ()
   auto problem_matrix    = load_matrix<compute_type> (argument[1]);
   decltype (problem_matrix) constraint_matrix;
 
-  auto opt = get_options ("constraint");
+  opt = get_options ("constraint");
   if (opt.size()) {
     constraint_matrix = load_matrix<compute_type> (opt[0][0]);
     if (problem_matrix.cols() != constraint_matrix.cols())
@@ -118,25 +208,101 @@ void run ()
 
   Math::ICLS::Problem<compute_type> problem (problem_matrix, constraint_matrix, solution_norm_reg, constraint_norm_reg, max_iterations, tolerance);
 
-  auto in = Image<value_type>::open (argument[0]);
+  // Estimate the memory use and run time before loading any data: the solver workspace of each thread
+  // holds matrices of up to (constraints x parameters) and (parameters x parameters), and the solver
+  // is assumed to take one iteration per parameter, each costing a product with the constraint matrix
+  {
+    const size_t m = problem_matrix.rows(), n = problem_matrix.cols(), nc = constraint_matrix.rows();
+    const size_t n_threads = ThreadPool::shared().size();
+    Header in_header = Header::open (argument[0]);
+    Header out_header (in_header);
+    out_header.size (3) = n;
+    out_header.datatype() = DataType::Float32;
+    Header prediction_header (in_header);
+    prediction_header.datatype() = DataType::Float32;
+    const double num_voxels = voxel_count (in_header, 0, 3);
+
+    auto prediction_opt = get_options ("prediction");
+    const bool compressed = MemoryPlan::held_in_memory (argument[0]) || MemoryPlan::held_in_memory (argument[2]) ||
+                            (prediction_opt.size() && MemoryPlan::held_in_memory (prediction_opt[0][0]));
+    MemoryPlan plan (compressed ? "voxel-wise fit, with compressed images held in memory" : "voxel-wise fit over memory-mapped images");
+    plan.add ("problem and constraint matrices", sizeof (compute_type) * (m * n + 2 * nc * n + 2 * n * n));
+    plan.add ("solver workspace (" + str(n_threads) + " threads)", n_threads * sizeof (compute_type) * (2 * nc * n + 2 * n * n + 2 * (m + n + nc)));
+    plan.add_image ("input image", in_header, argument[0]);
+    plan.add_image ("output image", out_header, argument[2]);
+    if (prediction_opt.size())
+      plan.add_image ("prediction image", prediction_header, prediction_opt[0][0]);
+    plan.add_pass ("reading input image", voxel_count (in_header) * in_header.datatype().bytes() / (PLAN_READ_MB_PER_SECOND * (1 << 20)));
+    plan.add_pass ("fit", 1.0e-9 * PLAN_NS_PER_MULTIPLY_ADD * num_voxels * (m * n + n * (nc * n + n * n)) / n_threads);
+
+    if (get_options ("dry_run").size()) {
+      plan.print();
+      return;
+    }
+    const size_t memory_limit = size_t (get_option_value<int64_t> ("memory_limit", 0)) << 20;
+    if (memory_limit && plan.peak_bytes() > memory_limit)
+      throw Exception ("estimated peak memory use (" + str(plan.peak_bytes() >> 20) + " MB) exceeds the limit of " + str(memory_limit >> 20) +
+                       " MB; store images uncompressed so that they can be memory-mapped rather than held in memory");
+    INFO ("execution strategy: " + plan.strategy + "; estimated peak memory " + str(plan.peak_bytes() >> 20) + " MB");
+  }
+
+  std::unique_ptr<Timings::Phase> loading (new Timings::Phase ("loading"));
+  auto in = open_image<value_type> (argument[0], false, true);
+  huge_pages (in, MemoryPlan::held_in_memory (argument[0]) ? "input image" : "input image (memory-mapped)");
   if (in.size(3) != ssize_t (problem.num_measurements()))
     throw Exception ("number of volumes in input image \"" + std::string (argument[0]) + "\" does not match number of columns in problem matrix \"" + std::string (argument[1]) + "\"");
 
   
   opt = get_options ("prediction");
   Image<value_type> prediction;
+  std::unique_ptr<ParallelGZ::Output> prediction_file;
   if (opt.size()) {
     Header header = in;
     header.datatype() = DataType::Float32;
-    prediction = Image<value_type>::create (opt[0][0], header);
+    prediction_file.reset (new ParallelGZ::Output (opt[0][0]));
+    prediction = prediction_file->create<value_type> (header);
+    if (MemoryPlan::held_in_memory (opt[0][0]))
+      first_touch (prediction, "prediction image");
+    else
+      huge_pages (prediction, "prediction image (memory-mapped)");
   }
 
   Header header (in);
   header.size (3) = problem.num_parameters();
   header.datatype() = DataType::Float32;
-  auto out = Image<value_type>::create (argument[2], header);
+  ParallelGZ::Output out_file (argument[2]);
+  auto out = out_file.create<value_type> (header);
+  if (MemoryPlan::held_in_memory (argument[2]))
+    first_touch (out, "output image");
+  else
+    huge_pages (out, "output image (memory-mapped)");
+  loading.reset();
+
+  FitStatistics statistics;
+  {
+    Timings::Phase fit ("fit");
+    // (fitting the slices of a compressed input image as they are decompressed)
+    TiledLoopAsAvailable ("performing constrained least-squares fit", vector<std::string> { in.name() }, { 0, in.size(2) },
+                          Processor (problem, prediction, statistics), in, out);
+  }
+  if (statistics.voxels) {
+    INFO ("solver iterations per voxel: " + str(double (statistics.iterations) / statistics.voxels) + "; " +
+          str(statistics.not_converged) + " of " + str(statistics.voxels) + " voxels failed to converge");
+    Timings::iteration ({ { "voxels", double (statistics.voxels) }, { "iterations_per_voxel", double (statistics.iterations) / statistics.voxels },
+                          { "not_converged", double (statistics.not_converged) } });
+  }
 
-  ThreadedLoop ("performing constrained least-squares fit", in, 0, 3)
-    .run (Processor (problem, prediction), in, out);
+  {
+    // compressed outputs are written once all images accessing their temporary files have been released
+    Timings::Phase output ("output");
+    in = Image<value_type>();
+    out = Image<value_type>();
+    prediction = Image<value_type>();
+    out_file.commit();
+    if (prediction_file)
+      prediction_file->commit();
+  }
+  HugePages::report();
+  Timings::report();
 }
 
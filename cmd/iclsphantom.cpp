@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "command.h"
+#include "image.h"
+#include "algo/loop.h"
+#include "math/math.h"
+
+#include <random>
+
+using namespace MR;
+using namespace App;
+
+#define DEFAULT_SIZE 32
+#define DEFAULT_PARAMETERS 3
+#define DEFAULT_VOLUMES 10
+#define DEFAULT_NOISE 0.01
+#define DEFAULT_BACKGROUND 0.1
+#define DEFAULT_ACTIVE 0.3
+
+void usage ()
+{
+  AUTHOR = "J-Donald Tournier (jdtournier@gmail.com)";
+
+  SYNOPSIS = "Generate a synthetic phantom with known solution for the icls command";
+
+  DESCRIPTION
+    + "The problem matrix H is drawn at random (uniformly within [0,1)), and the ground truth "
+      "solution of each voxel is either zero (background voxels), positive but with a random "
+      "subset of its parameters set to zero (voxels in which some of the non-negativity constraints "
+      "are active at the solution), or positive in all its parameters (uniformly within [0.1,1)). "
+      "The signal is then H times the ground truth, with added Gaussian noise."
+
+    + "The phantom is fully determined by the options, including the seed of the random number "
+      "generator, so that benchmarks can be repeated on identical data. "
+      "Example usage: iclsphantom signal.mif H.txt truth.mif -size 64,64,64 -volumes 30 -parameters 3; "
+      "icls signal.mif H.txt fractions.mif -timings_file timings.json.";
+
+  ARGUMENTS
+    + Argument ("signal", "the output signal image Y.").type_image_out ()
+    + Argument ("problem", "the output problem matrix H.").type_file_out ()
+    + Argument ("truth", "the output ground truth solution image X.").type_image_out ();
+
+  OPTIONS
+    + Option ("size", "the size of the image along each spatial axis (default: " + str(DEFAULT_SIZE) + "," + str(DEFAULT_SIZE) + "," + str(DEFAULT_SIZE) + ")")
+    +   Argument ("x,y,z").type_sequence_int()
+
+    + Option ("volumes", "the number of volumes (measurements) of the signal image (default: " + str(DEFAULT_VOLUMES) + ")")
+    +   Argument ("num").type_integer (1)
+
+    + Option ("parameters", "the number of parameters (volumes of the solution image) (default: " + str(DEFAULT_PARAMETERS) + ")")
+    +   Argument ("num").type_integer (1)
+
+    + Option ("noise", "the standard deviation of the Gaussian noise added to the signal (default: " + str(DEFAULT_NOISE) + ")")
+    +   Argument ("value").type_float (0.0)
+
+    + Option ("background", "the fraction of voxels with a zero solution (default: " + str(DEFAULT_BACKGROUND) + ")")
+    +   Argument ("value").type_float (0.0, 1.0)
+
+    + Option ("active", "the fraction of voxels with a random subset of the parameters of their solution set to zero, "
+                        "i.e. with some of the non-negativity constraints active (default: " + str(DEFAULT_ACTIVE) + ")")
+    +   Argument ("value").type_float (0.0, 1.0)
+
+    + Option ("seed", "the seed of the random number generator (default: 0)")
+    +   Argument ("value").type_integer (0);
+}
+
+
+
+void run ()
+{
+  vector<int> size (3, DEFAULT_SIZE);
+  auto opt = get_options ("size");
+  if (opt.size()) {
+    size = opt[0][0].as_sequence_int();
+    if (size.size() != 3 || size[0] < 1 || size[1] < 1 || size[2] < 1)
+      throw Exception ("the -size option expects three positive integers");
+  }
+  const size_t num_volumes = get_option_value ("volumes", DEFAULT_VOLUMES);
+  const size_t num_parameters = get_option_value ("parameters", DEFAULT_PARAMETERS);
+  const double noise = get_option_value ("noise", DEFAULT_NOISE);
+  const double background = get_option_value ("background", DEFAULT_BACKGROUND);
+  const double active = get_option_value ("active", DEFAULT_ACTIVE);
+  if (background + active > 1.0)
+    throw Exception ("the fractions of background and active voxels must not sum to more than 1");
+  if (num_parameters > num_volumes)
+    WARN ("more parameters than volumes: the ground truth will not be recoverable in general");
+
+  std::mt19937 rng (get_option_value ("seed", 0));
+  std::uniform_real_distribution<double> uniform (0.0, 1.0);
+  std::normal_distribution<double> gaussian (0.0, noise);
+
+  Eigen::MatrixXd H (num_volumes, num_parameters);
+  for (size_t i = 0; i < num_volumes; ++i)
+    for (size_t j = 0; j < num_parameters; ++j)
+      H(i,j) = uniform (rng);
+  save_matrix (H, argument[1]);
+
+  Header header;
+  header.ndim() = 4;
+  for (size_t n = 0; n < 3; ++n) {
+    header.size(n) = size[n];
+    header.spacing(n) = 2.0;
+  }
+  header.spacing(3) = 1.0;
+  header.transform().setIdentity();
+  header.datatype() = DataType::Float32;
+  Stride::set (header, Stride::contiguous_along_axis (3, header));
+
+  header.size(3) = num_volumes;
+  auto signal = Image<float>::create (argument[0], header);
+  header.size(3) = num_parameters;
+  auto truth = Image<float>::create (argument[2], header);
+
+  size_t num_background = 0, num_active = 0;
+  Eigen::VectorXd x (num_parameters), y (num_volumes);
+  for (auto l = Loop ("generating phantom", 0, 3) (signal, truth); l; ++l) {
+    const double u = uniform (rng);
+    if (u < background) {
+      x.setZero();
+      ++num_background;
+    }
+    else {
+      for (size_t j = 0; j < num_parameters; ++j)
+        x[j] = 0.1 + 0.9 * uniform (rng);
+      if (u < background + active && num_parameters > 1) {
+        // set a random subset of the parameters to zero (at least one, and at most num_parameters-1)
+        const size_t num_zero = 1 + size_t (uniform (rng) * (num_parameters - 1));
+        for (size_t k = 0; k < num_zero; ++k)
+          x[size_t (uniform (rng) * num_parameters)] = 0.0;
+        ++num_active;
+      }
+    }
+    y = H * x;
+    for (size_t i = 0; i < num_volumes; ++i)
+      y[i] += gaussian (rng);
+
+    for (auto v = Loop (3) (truth); v; ++v)
+      truth.value() = x[truth.index(3)];
+    for (auto v = Loop (3) (signal); v; ++v)
+      signal.value() = y[signal.index(3)];
+  }
+
+  INFO ("phantom of " + str(size[0]) + "x" + str(size[1]) + "x" + str(size[2]) + " voxels: " + str(num_background) +
+        " background voxels, " + str(num_active) + " voxels with active constraints");
+}
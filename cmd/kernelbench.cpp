@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "command.h"
+#include "image.h"
+#include "algo/loop.h"
+#include "math/constrained_least_squares.h"
+#include "transform.h"
+#include "poly_basis.h"
+#include "quantile_sketch.h"
+#include "thread_pool.h"
+#include "tiled_loop.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+using namespace MR;
+using namespace App;
+
+#define DEFAULT_WARMUP 3
+#define DEFAULT_REPETITIONS 20
+#define DEFAULT_SIZE 64
+
+const char* kernel_choices[] = { "icls_solve", "signal_gather", "poly_basis", "field_eval", "summed_log", "quartiles", "gram", nullptr };
+
+void usage ()
+{
+  AUTHOR = "J-Donald Tournier (jdtournier@gmail.com)";
+
+  SYNOPSIS = "Microbenchmarks of the per-voxel kernels of the icls and mtnormalise commands";
+
+  DESCRIPTION
+    + "Each kernel is run on synthetic data held in memory (without any file I/O), first for a number "
+      "of warm-up runs, and then for a number of timed repetitions, of which the median, mean, standard "
+      "deviation, minimum and maximum are reported, along with the throughput (items per second, "
+      "based on the median). The results are printed as a tab-separated table, one row per kernel and "
+      "variant, for comparison across builds or machines."
+
+    + "The kernels are: icls_solve, the constrained least-squares solve of a single voxel, for various "
+      "numbers of measurements and parameters; signal_gather, the copy of the volumes of a voxel into a "
+      "vector (as in icls), for volume-contiguous and volume-interleaved strides; poly_basis, the evaluation "
+      "of the polynomial basis of the mtnormalise field, for each order; field_eval, the evaluation of the "
+      "field over an image, for each order; summed_log, the pass computing the log of the balanced sum of "
+      "the tissue components over the field; quartiles, the computation of the outlier thresholds, "
+      "exactly and from a quantile sketch; and gram, the accumulation of the normal equations, for the "
+      "balance factors and for the field of each order."
+
+    + "The signal_gather, poly_basis, icls_solve, quartiles and gram kernels run in a single thread; "
+      "the field_eval and summed_log kernels are parallel passes over an image, using the number of "
+      "threads set by the -nthreads option.";
+
+  ARGUMENTS
+    + Argument ("kernel", "the kernel(s) to run (default: all), any of: icls_solve, signal_gather, poly_basis, "
+                          "field_eval, summed_log, quartiles, gram.").type_choice (kernel_choices).allow_multiple().optional();
+
+  OPTIONS
+    + Option ("warmup", "the number of untimed runs of each kernel before the timed repetitions (default: " + str(DEFAULT_WARMUP) + ")")
+    +   Argument ("num").type_integer (0)
+
+    + Option ("repetitions", "the number of timed repetitions of each kernel (default: " + str(DEFAULT_REPETITIONS) + ")")
+    +   Argument ("num").type_integer (1)
+
+    + Option ("size", "the size of the (cubic) synthetic image along each axis, which sets the number of "
+                      "voxels processed per repetition (default: " + str(DEFAULT_SIZE) + ")")
+    +   Argument ("num").type_integer (4);
+}
+
+
+
+// Timing statistics of the repetitions of a kernel, in seconds
+struct Statistics { NOMEMALIGN
+  double median, mean, stddev, min, max;
+};
+
+// Kept live so that the compiler cannot discard the results of the kernels
+volatile double sink = 0.0;
+
+size_t warmup = DEFAULT_WARMUP, repetitions = DEFAULT_REPETITIONS;
+
+// Run the kernel (returning a value derived from its results) for the warm-up runs, then time it
+template <class Kernel>
+Statistics measure (Kernel&& kernel)
+{
+  for (size_t n = 0; n < warmup; ++n)
+    sink = sink + kernel();
+  vector<double> times (repetitions);
+  for (auto& t : times) {
+    const auto start = std::chrono::steady_clock::now();
+    sink = sink + kernel();
+    t = std::chrono::duration<double> (std::chrono::steady_clock::now() - start).count();
+  }
+  Statistics s;
+  std::sort (times.begin(), times.end());
+  s.min = times.front();
+  s.max = times.back();
+  s.median = times.size() % 2 ? times[times.size()/2] : 0.5 * (times[times.size()/2 - 1] + times[times.size()/2]);
+  s.mean = 0.0;
+  for (auto t : times)
+    s.mean += t;
+  s.mean /= times.size();
+  s.stddev = 0.0;
+  for (auto t : times)
+    s.stddev += (t - s.mean) * (t - s.mean);
+  s.stddev = times.size() > 1 ? std::sqrt (s.stddev / (times.size() - 1)) : 0.0;
+  return s;
+}
+
+void report (const std::string& kernel, const std::string& variant, size_t threads, size_t items, const Statistics& s)
+{
+  std::cout << kernel << "\t" << variant << "\t" << threads << "\t" << items << "\t"
+            << 1.0e3 * s.median << "\t" << 1.0e3 * s.mean << "\t" << 1.0e3 * s.stddev << "\t"
+            << 1.0e3 * s.min << "\t" << 1.0e3 * s.max << "\t" << items / s.median << "\n";
+}
+
+Header synthetic_header (ssize_t size, size_t volumes, bool volumes_contiguous)
+{
+  Header header;
+  header.ndim() = volumes ? 4 : 3;
+  for (size_t n = 0; n < 3; ++n) {
+    header.size(n) = size;
+    header.spacing(n) = 2.0;
+  }
+  if (volumes) {
+    header.size(3) = volumes;
+    header.spacing(3) = 1.0;
+  }
+  header.transform().setIdentity();
+  header.datatype() = DataType::Float32;
+  if (volumes && volumes_contiguous)
+    Stride::set (header, Stride::contiguous_along_axis (3, header));
+  return header;
+}
+
+template <class ImageType>
+void fill (ImageType& image, std::mt19937& rng, float lower, float upper)
+{
+  std::uniform_real_distribution<float> uniform (lower, upper);
+  for (auto l = Loop (0, image.ndim()) (image); l; ++l)
+    image.value() = uniform (rng);
+}
+
+
+
+void icls_solve (size_t num_voxels, std::mt19937& rng)
+{
+  std::uniform_real_distribution<double> uniform (0.0, 1.0);
+  for (const auto& size : vector<std::pair<size_t, size_t>> { { 10, 3 }, { 30, 3 }, { 60, 5 }, { 100, 10 } }) {
+    Eigen::MatrixXd H (size.first, size.second);
+    for (ssize_t i = 0; i < H.size(); ++i)
+      H.data()[i] = uniform (rng);
+    // signals of solutions with about a third of the non-negativity constraints active
+    Eigen::MatrixXd signals (size.first, num_voxels);
+    for (size_t v = 0; v < num_voxels; ++v) {
+      Eigen::VectorXd x (size.second);
+      for (size_t j = 0; j < size.second; ++j)
+        x[j] = uniform (rng) < 0.33 ? 0.0 : uniform (rng);
+      signals.col(v) = H * x;
+    }
+    Math::ICLS::Problem<double> problem (H, Eigen::MatrixXd::Identity (size.second, size.second), 0.0, 0.0, 0, 0.0);
+    Math::ICLS::Solver<double> solve (problem);
+    Eigen::VectorXd x (size.second), b (size.first);
+    report ("icls_solve", "m=" + str(size.first) + ",n=" + str(size.second), 1, num_voxels, measure ([&] {
+      double total = 0.0;
+      for (size_t v = 0; v < num_voxels; ++v) {
+        b = signals.col(v);
+        solve (x, b);
+        total += x[0];
+      }
+      return total;
+    }));
+  }
+}
+
+
+
+void signal_gather (ssize_t size, std::mt19937& rng)
+{
+  for (size_t volumes : { 10, 60 }) {
+    for (bool contiguous : { true, false }) {
+      auto image = Image<float>::scratch (synthetic_header (size, volumes, contiguous), "signal");
+      fill (image, rng, 0.0f, 1.0f);
+      Eigen::VectorXd b (volumes);
+      report ("signal_gather", "volumes=" + str(volumes) + (contiguous ? ",contiguous" : ",interleaved"), 1, voxel_count (image, 0, 3), measure ([&] {
+        double total = 0.0;
+        for (auto l = Loop (0, 3) (image); l; ++l) {
+          for (auto v = Loop (3) (image); v; ++v)
+            b[image.index(3)] = image.value();
+          total += b[0];
+        }
+        return total;
+      }));
+    }
+  }
+}
+
+
+
+void poly_basis (size_t num_voxels, std::mt19937& rng)
+{
+  std::uniform_real_distribution<double> uniform (-100.0, 100.0);
+  vector<Eigen::Vector3> positions (num_voxels);
+  for (auto& p : positions)
+    p = Eigen::Vector3 (uniform (rng), uniform (rng), uniform (rng));
+  for (bool planar : { false, true }) {
+    for (int order = 1; order <= 3; ++order) {
+      PolyBasisFunction basis_function (order, planar);
+      report ("poly_basis", "order=" + str(order) + (planar ? ",planar" : ""), 1, num_voxels, measure ([&] {
+        double total = 0.0;
+        for (const auto& p : positions)
+          total += basis_function (p)(basis_function.n_basis_vecs - 1);
+        return total;
+      }));
+    }
+  }
+}
+
+
+
+// As the NormField functor of mtnormalise, for a single region
+struct FieldEval { MEMALIGN (FieldEval)
+  FieldEval (const Eigen::VectorXd& weights, const Transform& transform, const PolyBasisFunction& basis_function) :
+    weights (weights), transform (transform), basis_function (basis_function) { }
+  void operator () (Image<float>& field) {
+    const Eigen::Vector3 pos = basis_function.position (transform, Eigen::Vector3 (field.index(0), field.index(1), field.index(2)));
+    field.value() = std::exp (basis_function (pos).dot (weights));
+  }
+  Eigen::VectorXd weights;
+  Transform transform;
+  PolyBasisFunction basis_function;
+};
+
+void field_eval (ssize_t size, std::mt19937& rng)
+{
+  std::uniform_real_distribution<double> uniform (-1.0e-3, 1.0e-3);
+  auto field = Image<float>::scratch (synthetic_header (size, 0, false), "field");
+  const Transform transform (field);
+  for (int order = 0; order <= 3; ++order) {
+    PolyBasisFunction basis_function (order);
+    Eigen::VectorXd weights (basis_function.n_basis_vecs);
+    for (ssize_t n = 0; n < weights.size(); ++n)
+      weights[n] = uniform (rng);
+    report ("field_eval", "order=" + str(order), ThreadPool::shared().size(), voxel_count (field), measure ([&] {
+      TiledLoop (FieldEval (weights, transform, basis_function), field);
+      return double (field.value());
+    }));
+  }
+}
+
+
+
+// As the SummedLog functor of mtnormalise, for three tissue types stored in single precision
+struct SummedLog { MEMALIGN (SummedLog)
+  SummedLog (const Eigen::Vector3d& balance_factors) : balance_factors (balance_factors) { }
+  void operator () (Image<float>& summed_log, Image<float>& tissues, Image<float>& field) {
+    const Eigen::Map<const Eigen::Matrix<float,3,1>> values (&tissues.value());
+    summed_log.value() = std::log (balance_factors.dot (values.cast<double>()) / field.value());
+  }
+  Eigen::Vector3d balance_factors;
+};
+
+void summed_log (ssize_t size, std::mt19937& rng)
+{
+  auto tissues = Image<float>::scratch (synthetic_header (size, 3, true), "tissues");
+  auto field = Image<float>::scratch (synthetic_header (size, 0, false), "field");
+  auto output = Image<float>::scratch (synthetic_header (size, 0, false), "summed_log");
+  fill (tissues, rng, 0.0f, 1.0f);
+  fill (field, rng, 0.5f, 2.0f);
+  tissues.index(3) = 0;
+  report ("summed_log", "tissues=3", ThreadPool::shared().size(), voxel_count (output), measure ([&] {
+    TiledLoop (SummedLog (Eigen::Vector3d (1.2, 0.9, 0.95)), output, tissues, field);
+    return double (output.value());
+  }));
+}
+
+
+
+void quartiles (size_t num_voxels, std::mt19937& rng)
+{
+  std::normal_distribution<float> gaussian (0.0f, 1.0f);
+  vector<float> values (num_voxels), buffer;
+  buffer.reserve (num_voxels);
+  for (auto& v : values)
+    v = gaussian (rng);
+  // as OutlierRejection in mtnormalise: exact quartiles by partial sorting of a copy of the values
+  report ("quartiles", "exact", 1, num_voxels, measure ([&] {
+    buffer.assign (values.begin(), values.end());
+    const auto lower = buffer.begin() + std::round ((buffer.size() - 1) * 0.25);
+    const auto upper = buffer.begin() + std::round ((buffer.size() - 1) * 0.75);
+    std::nth_element (buffer.begin(), lower, buffer.end());
+    std::nth_element (lower, upper, buffer.end());
+    return double (*upper - *lower);
+  }));
+  report ("quartiles", "sketch", 1, num_voxels, measure ([&] {
+    QuantileSketch sketch;
+    for (auto v : values)
+      sketch.insert (v);
+    return double (sketch.quantile (0.75) - sketch.quantile (0.25));
+  }));
+}
+
+
+
+void gram (size_t num_voxels, std::mt19937& rng)
+{
+  std::uniform_real_distribution<double> uniform (0.0, 1.0);
+  // as BalFactEquations in mtnormalise, for three tissue types
+  {
+    vector<Eigen::Vector3d> values (num_voxels);
+    for (auto& v : values)
+      v = Eigen::Vector3d (uniform (rng), uniform (rng), uniform (rng));
+    report ("gram", "balance,tissues=3", 1, num_voxels, measure ([&] {
+      Eigen::Matrix3d XtX (Eigen::Matrix3d::Zero());
+      Eigen::Vector3d Xty (Eigen::Vector3d::Zero());
+      for (const auto& x : values) {
+        XtX.noalias() += x * x.transpose();
+        Xty += x;
+      }
+      return XtX(0,0) + Xty[0];
+    }));
+  }
+  // as NormWeightsEquations in mtnormalise, for a single region
+  for (int order = 1; order <= 3; ++order) {
+    const int n = GetBasisVecs (order);
+    Eigen::MatrixXd basis (n, num_voxels);
+    for (ssize_t i = 0; i < basis.size(); ++i)
+      basis.data()[i] = uniform (rng);
+    Eigen::MatrixXd XtX (n, n);
+    Eigen::VectorXd Xty (n);
+    report ("gram", "field,order=" + str(order), 1, num_voxels, measure ([&] {
+      XtX.setZero();
+      Xty.setZero();
+      for (size_t v = 0; v < num_voxels; ++v) {
+        XtX.selfadjointView<Eigen::Lower>().rankUpdate (basis.col(v));
+        Xty += 0.5 * basis.col(v);
+      }
+      return XtX(n-1,n-1) + Xty[0];
+    }));
+  }
+}
+
+
+
+void run ()
+{
+  warmup = get_option_value ("warmup", DEFAULT_WARMUP);
+  repetitions = get_option_value ("repetitions", DEFAULT_REPETITIONS);
+  const ssize_t size = get_option_value ("size", DEFAULT_SIZE);
+  const size_t num_voxels = size * size * size;
+
+  vector<bool> selected (7, argument.empty());
+  for (const auto& arg : argument)
+    selected[int (arg)] = true;
+
+  std::mt19937 rng (0);
+  std::cout << "kernel\tvariant\tthreads\titems\tmedian_ms\tmean_ms\tstddev_ms\tmin_ms\tmax_ms\titems_per_s\n";
+  if (selected[0]) icls_solve (num_voxels / 8, rng);
+  if (selected[1]) signal_gather (size, rng);
+  if (selected[2]) poly_basis (num_voxels, rng);
+  if (selected[3]) field_eval (size, rng);
+  if (selected[4]) summed_log (size, rng);
+  if (selected[5]) quartiles (num_voxels, rng);
+  if (selected[6]) gram (num_voxels, rng);
+}
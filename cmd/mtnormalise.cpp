@@ -15,11 +15,35 @@
 
 #include "command.h"
 #include "image.h"
+#include "apply.h"
 #include "algo/loop.h"
 #include "transform.h"
 #include "math/least_squares.h"
-#include "algo/threaded_copy.h"
-#include "adapter/replicate.h"
+#include "math/math.h"
+#include "file/utils.h"
+#include "alloc_stats.h"
+#include "content_hash.h"
+#include "huge_pages.h"
+#include "memory_plan.h"
+#include "parallel_gzip.h"
+#include "poly_basis.h"
+#include "quantile_sketch.h"
+#include "scratch_file.h"
+#include "shard.h"
+#include "thread_pool.h"
+#include "tiled_loop.h"
+#include "timings.h"
+#include "trace.h"
+
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <set>
+#include <tuple>
+#include <unistd.h>
+#ifdef __F16C__
+# include <immintrin.h>
+#endif
 
 using namespace MR;
 using namespace App;
@@ -30,6 +54,7 @@ using namespace App;
 #define DEFAULT_POLY_ORDER 3
 
 const char* poly_order_choices[] = { "0", "1", "2", "3", nullptr };
+const char* precision_choices[] = { "float32", "float16", "bfloat16", nullptr };
 
 void usage ()
 {
@@ -54,11 +79,60 @@ void usage ()
      "accounted for and reoptimised as the intensity inhomogeneity estimation becomes "
      "more accurate."
 
-   + "Example usage: mtnormalise wmfod.mif wmfod_norm.mif gm.mif gm_norm.mif csf.mif csf_norm.mif -mask mask.mif.";
+   + "Example usage: mtnormalise wmfod.mif wmfod_norm.mif gm.mif gm_norm.mif csf.mif csf_norm.mif -mask mask.mif."
+
+   + "If the -inplace option is specified, only the input images are provided, and these "
+     "are normalised in place rather than written out as new images (e.g. mtnormalise "
+     "wmfod.mif gm.mif csf.mif -mask mask.mif -inplace). Each input image is then memory-mapped "
+     "for both reading and writing, and must therefore be stored uncompressed in MRtrix format "
+     "(.mif/.mih), whose header is then updated with the lognorm entries (for .mif images, "
+     "the data are shifted within the file if the header must grow)."
+
+   + "If the -multitissue option is specified, a single 4D input image is provided, holding one "
+     "tissue component per volume (e.g. as output by icls), along with a single 4D output image "
+     "(e.g. mtnormalise fractions.mif fractions_norm.mif -mask mask.mif -multitissue). The volumes "
+     "are accessed directly in the input and output images, without splitting them into separate files."
+
+   + "If the -labels option is specified, a separate normalisation field is fitted for each region "
+     "of the label image (e.g. for each hemisphere, or for the cerebellum), while the tissue balance "
+     "factors remain shared across all regions. The fields of all regions are fitted jointly, in a "
+     "single pass over the data per iteration. The regions are those of the distinct label values present "
+     "in the image (in increasing order of label value, e.g. in the file written by -export_fit), so "
+     "that sparse labels do not add empty regions. Each voxel of the image is normalised using the field "
+     "of its own region, including voxels outside the mask; regions without any voxel within the mask "
+     "are not normalised (their field is set to unity)."
+
+   + "If the -slicewise option is specified, a separate 2D normalisation field (a polynomial of the "
+     "in-plane voxel position, of the order set by the -order option) is fitted for each group of "
+     "consecutive slices, to account for slice-dependent intensity variations (e.g. in multiband "
+     "EPI). The outlier rejection and tissue balance factors remain global. Slice groups with too "
+     "few voxels within the mask to support the requested order are fitted with a constant only."
+
+   + "The fit can be initialised from the normalisation field weights and tissue balance factors "
+     "exported by a previous run (using the -export_fit and -init options), e.g. for another session "
+     "of the same subject, or a rerun after small edits to the mask. The weights of a 3D field are "
+     "expressed in scanner space; if the scanner space of the current images differs from that of "
+     "the previous run, the -init_transform option provides the linear transform mapping scanner "
+     "positions of the current images onto those of the previous run. Combined with the -tolerance "
+     "option, this often reduces the fit to one or two iterations."
+
+   + "If the -cache option is specified, the result of the fit (normalisation field weights, tissue "
+     "balance factors and final mask) is stored in the given directory, keyed by a hash of the "
+     "contents of the input images, mask and label image, and of all options affecting the fit. "
+     "Subsequent runs with identical inputs and options then skip the fit entirely, and only "
+     "compute the outputs."
+
+   + "The fit can be distributed over several processes (e.g. on different nodes of a cluster) "
+     "using the -shard and -shard_dir options: each process is invoked with identical arguments "
+     "other than its shard index, and handles a contiguous range of slices along the z axis. "
+     "At each step of the fit, every shard writes its partial sums to the shared directory, "
+     "waits for those of all other shards, and combines them in the same order, so that all "
+     "shards proceed with identical balance factors, field weights and outlier thresholds. "
+     "The outputs are written by shard 0 only. A fresh (empty) directory must be used for each run.";
 
 
   ARGUMENTS
-    + Argument ("input output", "list of all input and output tissue compartment files. See example usage in the description.").type_various().allow_multiple();
+    + Argument ("input output", "list of all input and output tissue compartment files (or only the input files if the -inplace option is used). See example usage in the description.").type_various().allow_multiple();
 
   OPTIONS
     + OptionGroup ("Options that affect the operation of the mtnormalise command")
@@ -72,6 +146,19 @@ void usage ()
     + Option ("niter", "set the number of iterations. (default: " + str(DEFAULT_MAIN_ITER_VALUE) + ")")
     + Argument ("number").type_integer()
 
+    + Option ("tolerance", "stop iterating before the maximum number of iterations once the root-mean-square change of the "
+                           "log-domain normalisation field within the mask between successive iterations falls below this value. "
+                           "(default: 0, i.e. always perform the maximum number of iterations)")
+    + Argument ("value").type_float (0.0)
+
+    + Option ("init", "initialise the normalisation field weights and tissue balance factors from a file written "
+                      "by the -export_fit option of a previous run (with the same -order, -labels and -slicewise settings).")
+    + Argument ("file").type_file_in ()
+
+    + Option ("init_transform", "the linear transform mapping scanner positions of the current images onto those of the "
+                                "images from which the weights provided with -init were exported (3D fields only).")
+    + Argument ("file").type_file_in ()
+
     + Option ("value", "specify the (positive) reference value to which the summed tissue compartments will be normalised. "
                        "(default: " + str(DEFAULT_NORM_VALUE, 6) + ", SH DC term for unit angular integral)")
     + Argument ("number").type_float (std::numeric_limits<default_type>::min())
@@ -80,6 +167,88 @@ void usage ()
                           "(NOTE: use of this option has critical consequences for AFD intensity normalisation; "
                           "should not be used unless these consequences are fully understood)")
 
+    + Option ("memory_limit", "set an approximate upper limit (in MB) on the memory used for the scratch images during fitting. "
+                              "If holding the tissue components in memory would exceed this limit, they are instead held at 16 bits "
+                              "per value (bfloat16) if this suffices and the -precision option is not provided, or otherwise streamed from the "
+                              "input images in slabs along the z axis on every pass, with the outlier thresholds estimated from mergeable "
+                              "quantile sketches. Note that compressed input images are always held in memory in their entirety. "
+                              "The chosen strategy and the estimated peak memory use are reported at -info, or by the -dry_run option. "
+                              "(default: no limit)")
+    + Argument ("MB").type_integer (1)
+
+    + Option ("dry_run", "report the execution strategy, and estimates of the peak memory use and of the run time, "
+                         "without loading the tissue components or performing the fit.")
+
+    + Option ("precision", "the precision at which the tissue components are stored during fitting: float32, or one of "
+                           "the 16-bit formats float16 (IEEE half precision; values above 65504 are clamped) and bfloat16 "
+                           "(the range of float32, with fewer significant digits), halving the memory and bandwidth required. "
+                           "The resulting bound on the change of the fitted field is reported at -info. (default: float32)")
+    + Argument ("type").type_choice (precision_choices)
+
+    + Option ("scratch_dir", "back the scratch images used during fitting (tissue components, normalisation field, summed_log "
+                             "and processing masks) by temporary memory-mapped files in the given directory (e.g. on fast local storage), "
+                             "rather than holding them in memory, so that the system keeps in memory only the pages in use. "
+                             "The -memory_limit option then only applies to the remaining buffers. The files are removed "
+                             "from the directory as soon as they are created, and their space is released on exit.")
+    + Argument ("path").type_directory_in ()
+
+    + Option ("pin_threads", "pin each thread to its own core, and place the pages of the scratch images (and of compressed output "
+                             "images) in memory on the NUMA node of the thread that processes them, which reduces the memory traffic "
+                             "between sockets on multi-socket systems. (default: as set by the ThreadAffinity config entry)")
+
+    + Option ("huge_pages", "back the scratch images (and compressed output images, held in memory) with transparent huge pages, "
+                            "which reduces the TLB misses incurred by each pass over large images (as reported by the -perf_counters option); "
+                            "normal pages are used if huge pages are unavailable, as reported at -info. "
+                            "(default: as set by the HugePages config entry)")
+
+    + Option ("cache", "store the result of the fit in, and retrieve it from, a cache in the given directory, "
+                       "keyed by the contents of the input images, mask and label image and by the options affecting the fit.")
+    + Argument ("path").type_directory_in ()
+
+    + Option ("labels", "fit a separate normalisation field for each region of the provided label image "
+                        "(non-negative integer labels), with the tissue balance factors shared across all regions.")
+    + Argument ("image").type_image_in ()
+
+    + Option ("slicewise", "fit a separate 2D normalisation field for each group of N consecutive slices (N = 1 for one field per slice), "
+                           "rather than a single 3D field over the whole image.")
+    + Argument ("N").type_integer (1)
+
+    + Option ("multitissue", "treat each volume of a single 4D input image as a separate tissue component, "
+                             "and write the normalised tissue components to a single 4D output image (or in place, if -inplace is used).")
+
+    + Option ("inplace", "normalise the input images in place, rather than writing the results to new output images. "
+                         "In this mode, only the input images are provided as arguments; their lognorm_scale "
+                         "(and, if -balanced is used, lognorm_balance) header entries are updated. "
+                         "Only uncompressed MRtrix format images (.mif/.mih) are supported.")
+
+    + OptionGroup ("Options for distributing the fit over several processes")
+
+    + Option ("shard", "run as shard number 'index' (starting from 0) of 'count' processes, each handling a subset of the slices "
+                       "of the image. This requires the -shard_dir option.")
+    + Argument ("index").type_integer (0)
+    + Argument ("count").type_integer (1)
+
+    + Option ("shard_dir", "the directory, on a filesystem shared by all shards, through which partial results are exchanged.")
+    + Argument ("path").type_directory_in ()
+
+    + OptionGroup ("Options for reporting on the performance of the mtnormalise command")
+
+    + Option ("timings", "report the wall-clock and CPU time spent in each phase of the command (loading, RefinedMask, "
+                         "OutlierRejection, balance solve, field solve, field evaluation and output), along with the number "
+                         "of balance iterations and of voxels within the mask at each iteration.")
+
+    + Option ("timings_file", "write the timings of the -timings option to file, in JSON format.")
+    + Argument ("file").type_file_out ()
+
+    + Option ("perf_counters", "also record the hardware performance counters (CPU cycles, instructions, last-level cache misses, "
+                               "branch misses and data TLB misses) of each phase, summed over all threads (and per thread in the file of the "
+                               "-timings_file option); implies -timings unless -timings_file is provided. This requires "
+                               "access to the perf_event interface of the Linux kernel; if unavailable, only the timings are reported.")
+
+    + Option ("trace", "record a timeline of the phases, iterations and parallel loops executed by each thread, "
+                       "written to file in Chrome trace-event format (for viewing in chrome://tracing or Perfetto).")
+    + Argument ("file").type_file_out ()
+
     + OptionGroup ("Options for outputting data to verify successful operation of the mtnormalise command")
 
     + Option ("check_norm", "output the final estimated spatially varying intensity level that is used for normalisation.")
@@ -90,6 +259,10 @@ void usage ()
     + Argument ("image").type_image_out ()
 
     + Option ("check_factors", "output the tissue balance factors computed during normalisation.")
+    + Argument ("file").type_file_out ()
+
+    + Option ("export_fit", "output the final normalisation field weights and tissue balance factors, "
+                            "for use with the -init option of a subsequent run.")
     + Argument ("file").type_file_out ();
 
 }
@@ -98,318 +271,1550 @@ void usage ()
 using ValueType = float;
 using ImageType = Image<ValueType>;
 using MaskType = Image<bool>;
+using LabelType = Image<uint32_t>;
+
+// The per-voxel tissue kernels below are specialised at compile time for up to
+// MAX_FIXED_TISSUE_TYPES tissue types, using fixed-size vectors so that the loops
+// over tissue types are unrolled; larger numbers of tissue types use the generic
+// (Eigen::Dynamic) path. They rely on the tissue-interleaved layout of the combined
+// tissue image, with all tissue values of a voxel adjacent in memory.
+#define MAX_FIXED_TISSUE_TYPES 4
+
+template <int NumTissues>
+using TissueVector = Eigen::Matrix<double, NumTissues, 1>;
+
+template <int NumTissues>
+using TissueValuesMap = Eigen::Map<const Eigen::Matrix<ValueType, NumTissues, 1>, Eigen::Unaligned, Eigen::InnerStride<>>;
+
+// Formats in which the tissue components are stored during fitting: single precision, or
+// 16 bits per value (IEEE half precision, or bfloat16, i.e. the upper half of a single
+// precision value). The tissue kernels are also specialised for the storage format, with
+// 16-bit values widened to single precision on the fly as they are accessed.
+enum class TissuePrecision { Float32, Float16, BFloat16 };
+
+struct Float32Storage {
+  using value_type = ValueType;
+  static FORCE_INLINE ValueType narrow (float x) { return x; }
+  static FORCE_INLINE float widen (ValueType x) { return x; }
+};
 
-// Function to get the number of basis vectors based on the desired order
-int GetBasisVecs(int order)
-{
-  int n_basis_vecs;
-    switch (order) {
-      case 0:
-        n_basis_vecs = 1;
-        break;
-      case 1:
-        n_basis_vecs = 4;
-        break;
-      case 2:
-        n_basis_vecs = 10;
-        break;
-      default:
-        n_basis_vecs = 20;
-        break;
+struct Float16Storage {
+  using value_type = uint16_t;
+
+  // Round to nearest (ties to even), clamping finite values to the largest half precision value
+  static FORCE_INLINE uint16_t narrow (float x) {
+#ifdef __F16C__
+    return _cvtss_sh (std::isfinite (x) ? std::min (std::max (x, -65504.f), 65504.f) : x, _MM_FROUND_TO_NEAREST_INT);
+#else
+    uint32_t bits;
+    std::memcpy (&bits, &x, sizeof (bits));
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7FFFFFFF;
+    if (bits >= 0x7F800000)
+      return sign | (bits > 0x7F800000 ? 0x7E00 : 0x7C00);
+    if (bits >= 0x477FF000)
+      return sign | 0x7BFF;
+    if (bits < 0x38800000) {
+      // subnormal in half precision
+      if (bits < 0x33000000)
+        return sign;
+      const uint32_t shift = 126 - (bits >> 23);
+      const uint32_t mantissa = (bits & 0x7FFFFF) | 0x800000;
+      uint32_t half = mantissa >> shift;
+      const uint32_t remainder = mantissa & ((1u << shift) - 1), midpoint = 1u << (shift - 1);
+      if (remainder > midpoint || (remainder == midpoint && (half & 1)))
+        ++half;
+      return sign | half;
+    }
+    uint32_t half = (bits - 0x38000000) >> 13;
+    const uint32_t remainder = bits & 0x1FFF;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+      ++half;
+    return sign | half;
+#endif
+  }
+
+  static FORCE_INLINE float widen (uint16_t x) {
+#ifdef __F16C__
+    return _cvtsh_ss (x);
+#else
+    const uint32_t sign = uint32_t (x & 0x8000) << 16, exponent = (x >> 10) & 0x1F, mantissa = x & 0x3FF;
+    if (!exponent) {
+      const float value = std::ldexp (float (mantissa), -24);
+      return sign ? -value : value;
+    }
+    const uint32_t bits = sign | (exponent == 31 ? 0x7F800000 : (exponent + 112) << 23) | (mantissa << 13);
+    float value;
+    std::memcpy (&value, &bits, sizeof (value));
+    return value;
+#endif
+  }
+
+  static FORCE_INLINE void widen (const uint16_t* in, ssize_t stride, ssize_t n, float* out) {
+    ssize_t j = 0;
+#ifdef __F16C__
+    if (stride == 1) {
+      for (; j + 4 <= n; j += 4)
+        _mm_storeu_ps (out + j, _mm_cvtph_ps (_mm_loadl_epi64 (reinterpret_cast<const __m128i*> (in + j))));
+    }
+#endif
+    for (; j < n; ++j)
+      out[j] = widen (in[j*stride]);
+  }
+};
+
+struct BFloat16Storage {
+  using value_type = uint16_t;
+
+  // Round to nearest (ties to even)
+  static FORCE_INLINE uint16_t narrow (float x) {
+    uint32_t bits;
+    std::memcpy (&bits, &x, sizeof (bits));
+    if (std::isnan (x))
+      return (bits >> 16) | 0x0040;
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return bits >> 16;
+  }
+
+  static FORCE_INLINE float widen (uint16_t x) {
+    const uint32_t bits = uint32_t (x) << 16;
+    float value;
+    std::memcpy (&value, &bits, sizeof (value));
+    return value;
+  }
+
+  // (a plain shift per value, which the compiler vectorises for contiguous values)
+  static FORCE_INLINE void widen (const uint16_t* in, ssize_t stride, ssize_t n, float* out) {
+    for (ssize_t j = 0; j < n; ++j)
+      out[j] = widen (in[j*stride]);
+  }
+};
+
+template <class Storage>
+using TissueImageType = Image<typename Storage::value_type>;
+
+// Function to access all tissue values of the current voxel of the combined tissue image
+template <int NumTissues, class Storage>
+FORCE_INLINE TissueValuesMap<NumTissues> TissueValues(const ImageType& combined_tissue){
+  return TissueValuesMap<NumTissues> (combined_tissue.address(), combined_tissue.size(3), Eigen::InnerStride<> (combined_tissue.stride(3)));
+};
+
+// (widened to single precision if stored at 16 bits per value)
+template <int NumTissues, class Storage>
+FORCE_INLINE Eigen::Matrix<ValueType, NumTissues, 1> TissueValues(const Image<uint16_t>& combined_tissue){
+  Eigen::Matrix<ValueType, NumTissues, 1> values;
+  values.resize (combined_tissue.size(3));
+  Storage::widen (combined_tissue.address(), combined_tissue.stride(3), combined_tissue.size(3), values.data());
+  return values;
+};
+
+// Function to invoke the kernel specialised for the storage format and number of tissue types
+template <template <int, class> class Kernel, class Storage, class... Args>
+FORCE_INLINE void RunTissueKernel(size_t n_tissue_types, Args&&... args){
+  static_assert (MAX_FIXED_TISSUE_TYPES == 4, "tissue kernel dispatch must be updated to match MAX_FIXED_TISSUE_TYPES");
+  switch (n_tissue_types) {
+    case 1: Kernel<1, Storage>::run (std::forward<Args> (args)...); break;
+    case 2: Kernel<2, Storage>::run (std::forward<Args> (args)...); break;
+    case 3: Kernel<3, Storage>::run (std::forward<Args> (args)...); break;
+    case 4: Kernel<4, Storage>::run (std::forward<Args> (args)...); break;
+    default: Kernel<Eigen::Dynamic, Storage>::run (std::forward<Args> (args)...); break;
+  }
+};
+
+// Function to position an image of the whole volume at the current voxel of a slab image
+template <class SlabType, class VolumeType>
+FORCE_INLINE void AssignSlabPos(const SlabType& slab_image, VolumeType& volume_image, ssize_t slab_offset){
+  volume_image.index(0) = slab_image.index(0);
+  volume_image.index(1) = slab_image.index(1);
+  volume_image.index(2) = slab_image.index(2) + slab_offset;
+};
+
+// Struct providing a zero-copy view of the volumes of an image holding one tissue component:
+// either all volumes of the image (e.g. the SH coefficients of a tissue ODF), or a single
+// volume of a 4D image holding all tissue components along axis 3
+struct TissueView { MEMALIGN (TissueView)
+  TissueView (const ImageType& image, ssize_t first_volume, ssize_t n_vols) : image (image), first_volume (first_volume), n_vols (n_vols) { }
+
+  // Position the view at the voxel of a slab image, on the first volume of the tissue component
+  template <class SlabType>
+  FORCE_INLINE void set_voxel (const SlabType& slab_image, ssize_t slab_offset = 0) {
+    AssignSlabPos (slab_image, image, slab_offset);
+    set_volume (0);
+  }
+
+  FORCE_INLINE void set_volume (ssize_t volume) {
+    if (image.ndim() > 3)
+      image.index(3) = first_volume + volume;
+  }
+
+  FORCE_INLINE ValueType value () { return image.value(); }
+
+  ImageType image;
+  ssize_t first_volume, n_vols;
+};
+
+// Struct holding the normal equations (X^T X and X^T y) of a linear least-squares problem,
+// accumulated over voxels so that the design matrix itself never needs to be stored.
+// Only the lower triangle of XtX is referenced when solving. For block-diagonal problems
+// (e.g. independent fields for separate regions), only the diagonal blocks of XtX are
+// stored, side by side.
+template <int Size>
+struct NormalEquations { MEMALIGN (NormalEquations<Size>)
+  NormalEquations (size_t n) : NormalEquations (n, n) { }
+  NormalEquations (size_t n, size_t block_size) : XtX (Eigen::Matrix<double, Size, Size>::Zero (block_size, n)), Xty (Eigen::Matrix<double, Size, 1>::Zero (n)), count (0) { }
+
+  template <int OtherSize>
+  NormalEquations& operator+= (const NormalEquations<OtherSize>& other) {
+    XtX += other.XtX;
+    Xty += other.Xty;
+    count += other.count;
+    return *this;
+  }
+
+  size_t size () const { return Xty.size(); }
+  size_t block_size () const { return XtX.rows(); }
+
+  // Solve the system, block by block if block-diagonal. The (independent) blocks are solved in
+  // parallel. Each block is expected to hold the equations of a field whose first basis function is
+  // constant, so that XtX(0,b) holds its number of voxels: blocks with too few voxels to determine
+  // all their weights reliably are fitted with the constant term only, and empty blocks yield zero weights.
+  Eigen::VectorXd solve () const {
+    if (block_size() == size())
+      return XtX.llt().solve (Xty);
+
+    struct BlockSolver { NOMEMALIGN
+      void execute () {
+        const size_t n = equations.block_size();
+        size_t b;
+        while ((b = n * next++) < equations.size()) {
+          const double block_voxels = equations.XtX(0,b);
+          if (block_voxels >= 10.0 * n)
+            x.segment (b, n) = equations.block (b).llt().solve (equations.Xty.segment (b, n));
+          else if (block_voxels > 0.0)
+            x[b] = equations.Xty[b] / block_voxels;
+        }
       }
-  return n_basis_vecs;
-};
-
-//PolyBasisFunction struct to get the user specified amount of basis functions
-struct PolyBasisFunction { MEMALIGN (PolyBasisFunction)
-
-  PolyBasisFunction(const int order) : n_basis_vecs (GetBasisVecs(order)) { };
-
-  const int n_basis_vecs;
-
-  FORCE_INLINE Eigen::MatrixXd operator () (const Eigen::Vector3& pos) {
-    double x = pos[0];
-    double y = pos[1];
-    double z = pos[2];
-    Eigen::MatrixXd basis(n_basis_vecs, 1);
-    basis(0) = 1.0;
-    if (n_basis_vecs < 4)
-      return basis;
-
-    basis(1) = x;
-    basis(2) = y;
-    basis(3) = z;
-    if (n_basis_vecs < 10)
-      return basis;
-
-    basis(4) = x * x;
-    basis(5) = y * y;
-    basis(6) = z * z;
-    basis(7) = x * y;
-    basis(8) = x * z;
-    basis(9) = y * z;
-    if (n_basis_vecs < 20)
-      return basis;
-
-    basis(10) = x * x * x;
-    basis(11) = y * y * y;
-    basis(12) = z * z * z;
-    basis(13) = x * x * y;
-    basis(14) = x * x * z;
-    basis(15) = y * y * x;
-    basis(16) = y * y * z;
-    basis(17) = z * z * x;
-    basis(18) = z * z * y;
-    basis(19) = x * y * z;
-  return basis;
-  }
-};
-
-// Struct calculating the initial summed_log values
-struct SummedLog {
-  SummedLog (const size_t n_tissue_types, Eigen::VectorXd balance_factors) : n_tissue_types (n_tissue_types), balance_factors (balance_factors) { }
-
-  void operator () (ImageType& summed_log, ImageType& combined_tissue, ImageType& norm_field_image) {
-      for (size_t j = 0; j < n_tissue_types; ++j) {
-        combined_tissue.index(3) = j;
-        summed_log.value() += balance_factors(j) * combined_tissue.value() / norm_field_image.value();
+      const NormalEquations& equations;
+      Eigen::VectorXd& x;
+      std::atomic<size_t>& next;
+    };
+
+    Eigen::VectorXd x (Eigen::VectorXd::Zero (size()));
+    std::atomic<size_t> next (0);
+    ThreadPool::shared().run_multi (BlockSolver { *this, x, next });
+    return x;
+  }
+
+  // Root-mean-square change of the fitted values over all data points, for a change dx of the solution
+  double rms_change (const Eigen::VectorXd& dx) const {
+    if (!count)
+      return 0.0;
+    double sum = 0.0;
+    for (size_t b = 0; b < size(); b += block_size())
+      sum += dx.segment (b, block_size()).dot (block (b).template selfadjointView<Eigen::Lower>() * dx.segment (b, block_size()));
+    return std::sqrt (std::max (sum, 0.0) / count);
+  }
+
+  // The diagonal block of XtX starting at row & column b
+  Eigen::Block<const Eigen::Matrix<double, Size, Size>> block (size_t b) const { return XtX.block (0, b, block_size(), block_size()); }
+
+  void clear () {
+    XtX.setZero();
+    Xty.setZero();
+    count = 0;
+  }
+
+  // Write the equations in text form, with sufficient precision to be read back exactly
+  void write (std::ostream& stream) const {
+    stream.precision (17);
+    stream << count << "\n";
+    for (ssize_t r = 0; r < XtX.rows(); ++r)
+      for (ssize_t c = 0; c < XtX.cols(); ++c)
+        stream << XtX(r,c) << " ";
+    for (ssize_t r = 0; r < Xty.size(); ++r)
+      stream << Xty(r) << " ";
+  }
+
+  // Add equations previously written by write()
+  void read (std::istream& stream) {
+    size_t other_count;
+    stream >> other_count;
+    count += other_count;
+    double value;
+    for (ssize_t r = 0; r < XtX.rows(); ++r)
+      for (ssize_t c = 0; c < XtX.cols(); ++c) {
+        stream >> value;
+        XtX(r,c) += value;
       }
-  summed_log.value() = std::log(summed_log.value());
+    for (ssize_t r = 0; r < Xty.size(); ++r) {
+      stream >> value;
+      Xty(r) += value;
+    }
+    if (!stream)
+      throw Exception ("error reading partial normal equations");
   }
 
-  const size_t n_tissue_types;
-  Eigen::VectorXd balance_factors;
+  Eigen::Matrix<double, Size, Size> XtX;
+  Eigen::Matrix<double, Size, 1> Xty;
+  size_t count;
 };
 
-// Struct calculating the norm_field_log values
-struct NormFieldLog {
+// Struct holding normal equations accumulated concurrently by multiple threads
+struct SharedNormalEquations : public NormalEquations<Eigen::Dynamic> { NOMEMALIGN
+  SharedNormalEquations (size_t n) : NormalEquations<Eigen::Dynamic> (n) { }
+  SharedNormalEquations (size_t n, size_t block_size) : NormalEquations<Eigen::Dynamic> (n, block_size) { }
+
+  template <int Size>
+  void merge (const NormalEquations<Size>& other) {
+    std::lock_guard<std::mutex> lock (mutex);
+    *this += other;
+  }
+
+  std::mutex mutex;
+};
 
-   NormFieldLog (Eigen::MatrixXd norm_field_weights, Transform transform, struct PolyBasisFunction basis_function) : norm_field_weights (norm_field_weights), transform (transform), basis_function (basis_function){ }
+// Struct holding the normal equations accumulated by a single thread: each copy
+// starts empty, and is merged into the shared normal equations on destruction
+template <int Size>
+struct LocalNormalEquations : public NormalEquations<Size> { MEMALIGN (LocalNormalEquations<Size>)
+  LocalNormalEquations (SharedNormalEquations& shared) : NormalEquations<Size> (shared.size(), shared.block_size()), shared (shared) { }
+  LocalNormalEquations (const LocalNormalEquations& that) : NormalEquations<Size> (that.shared.size(), that.shared.block_size()), shared (that.shared) { }
+  ~LocalNormalEquations () { shared.merge (*this); }
 
-   void operator () (ImageType& norm_field_log) {
-       Eigen::Vector3 vox (norm_field_log.index(0), norm_field_log.index(1), norm_field_log.index(2));
-       Eigen::Vector3 pos = transform.voxel2scanner * vox;
-       norm_field_log.value() = basis_function (pos).col(0).dot (norm_field_weights.col(0));
+  SharedNormalEquations& shared;
+};
+
+// Function to combine partial results (normal equations or quantile sketches) over all shards.
+// All shards combine the same partial results in the same order, and so obtain identical results.
+template <class PartialType>
+void ReduceOverShards(Shard& shard, PartialType& partial){
+  if (!shard.active())
+    return;
+  std::ostringstream stream;
+  partial.write (stream);
+  const auto partials = shard.exchange (stream.str());
+  partial.clear();
+  for (const auto& p : partials) {
+    std::istringstream in (p);
+    partial.read (in);
+  }
+};
+
+// Function to sum a value over all shards
+template <typename T>
+T SumOverShards(Shard& shard, T value){
+  if (!shard.active())
+    return value;
+  std::ostringstream stream;
+  stream.precision (17);
+  stream << value;
+  T sum = 0;
+  for (const auto& p : shard.exchange (stream.str()))
+    sum += to<T> (p);
+  return sum;
+};
+
+// Struct identifying the region of each voxel for which a separate normalisation field is fitted:
+// each region of the label image (if provided, as dense region indices), split into groups of consecutive slices (in
+// slice-wise mode). The field weights of all regions are stacked, region by region.
+struct FieldRegions { MEMALIGN (FieldRegions)
+  FieldRegions () : n_labels (1), slices_per_group (0), n_groups (1) { }
+
+  size_t size () const { return n_labels * n_groups; }
+
+  // Index of the first field weight of the region of voxel (x,y,z)
+  FORCE_INLINE size_t weights_offset (ssize_t x, ssize_t y, ssize_t z, size_t n_basis_vecs) {
+    size_t region = 0;
+    if (labels.valid()) {
+      labels.index(0) = x;
+      labels.index(1) = y;
+      labels.index(2) = z;
+      region = labels.value() * n_groups;
+    }
+    if (slices_per_group)
+      region += z / slices_per_group;
+    return region * n_basis_vecs;
+  }
+
+  LabelType labels;
+  size_t n_labels;
+  ssize_t slices_per_group;
+  size_t n_groups;
+};
+
+// Struct evaluating the normalisation field from its log-domain polynomial weights
+struct NormField { MEMALIGN (NormField)
+
+   NormField (const Eigen::VectorXd& norm_field_weights, const Transform& transform, const struct PolyBasisFunction& basis_function, const FieldRegions& regions, ssize_t slab_offset) :
+     norm_field_weights (norm_field_weights), transform (transform), basis_function (basis_function), regions (regions), slab_offset (slab_offset) { }
+
+   void operator () (ImageType& norm_field_image) {
+       AllocStats::HotRegion hot ("NormField");
+       Eigen::Vector3 vox (norm_field_image.index(0), norm_field_image.index(1), norm_field_image.index(2) + slab_offset);
+       Eigen::Vector3 pos = basis_function.position (transform, vox);
+       const size_t offset = regions.weights_offset (norm_field_image.index(0), norm_field_image.index(1), norm_field_image.index(2) + slab_offset, basis_function.n_basis_vecs);
+       norm_field_image.value() = std::exp (basis_function (pos).dot (norm_field_weights.segment (offset, basis_function.n_basis_vecs)));
    }
 
-   Eigen::MatrixXd norm_field_weights;
+   Eigen::VectorXd norm_field_weights;
    Transform transform;
    struct PolyBasisFunction basis_function;
+   FieldRegions regions;
+   ssize_t slab_offset;
+};
+
+// Class holding the scratch buffers used during the fit, each allocated once on first use and
+// reused for all iterations: the scratch images for slabs of each depth (of which there are at
+// most two: that of all slabs but the last, and that of the last), and the buffer of summed_log
+// values used to compute exact quartiles, pre-sized from the number of voxels in the mask.
+class ScratchArena { MEMALIGN (ScratchArena)
+  public:
+    // The scratch images for one slab depth, and the slab (and field weights) they currently hold
+    struct SlabImages { MEMALIGN (SlabImages)
+      SlabImages () : tissue_slab (-1), field_slab (-1) { }
+      ImageType combined_tissue, norm_field_image, summed_log;
+      Image<uint16_t> reduced_tissue;
+      ssize_t tissue_slab, field_slab;
+      Eigen::VectorXd field_weights;
+    };
+
+    ScratchArena (const Header& header_3D, size_t n_tissue_types, TissuePrecision precision) :
+      header_3D (header_3D), n_tissue_types (n_tissue_types), precision (precision), allocated (0), peak (0) { }
+
+    // The scratch images for slabs of the given depth (including the tissue components if requested)
+    SlabImages& slab (ssize_t depth, bool with_tissue) {
+      SlabImages& images = slabs[depth];
+      Header header (header_3D);
+      header.size(2) = depth;
+      if (!images.norm_field_image.valid()) {
+        images.norm_field_image = scratch_image<ValueType> (header, "Normalisation field (intensity)", ScratchAccess::Sequential);
+        images.summed_log = scratch_image<ValueType> (header, "Log of summed tissue volumes", ScratchAccess::Sequential);
+        add (2 * voxel_count (header) * sizeof (ValueType));
+      }
+      if (with_tissue && !images.combined_tissue.valid() && !images.reduced_tissue.valid()) {
+        // Tissue types are interleaved (axis 3 contiguous), as expected by the tissue kernels
+        header.ndim() = 4;
+        header.size(3) = n_tissue_types;
+        Stride::set (header, Stride::contiguous_along_axis (3, header));
+        INFO ("scratch tissue components for slabs of " + str(depth) + " slices: strides [ " + str(header.stride(0)) + " " + str(header.stride(1)) + " " +
+              str(header.stride(2)) + " " + str(header.stride(3)) + " ] (tissue types interleaved)");
+        if (precision == TissuePrecision::Float32) {
+          images.combined_tissue = scratch_image<ValueType> (header, "Tissue components", ScratchAccess::Sequential);
+          add (voxel_count (header) * sizeof (ValueType));
+        } else {
+          images.reduced_tissue = scratch_image<uint16_t> (header, "Tissue components", ScratchAccess::Sequential);
+          add (voxel_count (header) * sizeof (uint16_t));
+        }
+      }
+      return images;
+    }
+
+    // Mark the contents of all scratch images as invalid
+    void invalidate () {
+      for (auto& images : slabs)
+        images.second.tissue_slab = images.second.field_slab = -1;
+    }
+
+    // Pre-size the buffer of summed_log values for the given number of voxels
+    void reserve_values (size_t num_voxels) {
+      if (summed_log_values.capacity() >= num_voxels)
+        return;
+      allocated -= summed_log_values.capacity() * sizeof (float);
+      summed_log_values.reserve (num_voxels);
+      add (summed_log_values.capacity() * sizeof (float));
+    }
+
+    // The (empty) buffer of summed_log values
+    vector<float>& values () {
+      summed_log_values.clear();
+      return summed_log_values;
+    }
+
+    size_t peak_bytes () const { return peak; }
+
+  protected:
+    Header header_3D;
+    size_t n_tissue_types;
+    TissuePrecision precision;
+    std::map<ssize_t, SlabImages> slabs;
+    vector<float> summed_log_values;
+    size_t allocated, peak;
+
+    void add (size_t bytes) {
+      allocated += bytes;
+      peak = std::max (peak, allocated);
+    }
+};
+
+// Class providing the zero-clamped tissue components, normalisation field and summed_log
+// scratch images in slabs along the z axis. If a single slab covers the whole image, the
+// tissue components are copied from the input images only once and kept in memory for the
+// whole fit; otherwise each slab is streamed from the input images whenever it is accessed,
+// so that the memory required is set by the slab depth rather than by the image size.
+// Only the range of slices [z_range.first, z_range.second) is covered (e.g. that of a shard).
+// All scratch buffers are provided by the arena. The tissue components are stored at the
+// requested precision; for 16-bit storage, the error introduced by rounding is recorded.
+class TissueSlabs { MEMALIGN (TissueSlabs)
+  public:
+    TissueSlabs (const vector<TissueView>& input_images, const Header& header_3D, const Transform& transform, const struct PolyBasisFunction& basis_function,
+                 const FieldRegions& regions, std::pair<ssize_t, ssize_t> z_range, ssize_t slab_depth, TissuePrecision precision = TissuePrecision::Float32) :
+      arena (header_3D, input_images.size(), precision),
+      storage_precision (precision),
+      input_images (input_images),
+      transform (transform),
+      basis_function (basis_function),
+      regions (regions),
+      z_range (z_range),
+      depth (std::max<ssize_t> (1, std::min (slab_depth, z_range.second - z_range.first))) { }
+
+    size_t num_slabs () const { return (z_range.second - z_range.first + depth - 1) / depth; }
+    bool in_memory () const { return num_slabs() == 1; }
+    ssize_t slab_depth () const { return depth; }
+    ssize_t offset (size_t n) const { return z_range.first + n * depth; }
+    size_t n_tissue_types () const { return input_images.size(); }
+    TissuePrecision precision () const { return storage_precision; }
+
+    // Change the range of slices covered, retaining the slab depth
+    void set_range (std::pair<ssize_t, ssize_t> new_range) {
+      z_range = new_range;
+      arena.invalidate();
+    }
+
+    // Load the tissue components of slab n, unless already loaded
+    void load_tissue (size_t n, ProgressBar* progress = nullptr) {
+      auto& images = arena.slab (size (n), true);
+      const bool first_load = images.tissue_slab < 0;
+      if (images.tissue_slab != ssize_t (n)) {
+        Timings::Phase phase ("loading");
+        switch (storage_precision) {
+          case TissuePrecision::Float32: load_tissue<Float32Storage> (images.combined_tissue, n, progress); break;
+          case TissuePrecision::Float16: load_tissue<Float16Storage> (images.reduced_tissue, n, progress); break;
+          case TissuePrecision::BFloat16: load_tissue<BFloat16Storage> (images.reduced_tissue, n, progress); break;
+        }
+        images.tissue_slab = n;
+      }
+      combined_tissue = images.combined_tissue;
+      reduced_tissue = images.reduced_tissue;
+      if (first_load) {
+        // (as traversed by the kernels accessing the tissue components along with the other scratch images)
+        const Tiling tiles (images.summed_log, storage_precision == TissuePrecision::Float32 ?
+                            bytes_per_voxel (images.combined_tissue, images.norm_field_image, images.summed_log) :
+                            bytes_per_voxel (images.reduced_tissue, images.norm_field_image, images.summed_log));
+        INFO ("slabs of " + str(tiles.nz) + " slices traversed in " + str(tiles.size()) + " tiles of " + str(tiles.rows) + " rows x " + str(tiles.slices) + " slices");
+      }
+    }
+
+    // Evaluate the normalisation field over slab n, unless already evaluated for these weights
+    void load_field (size_t n, const Eigen::VectorXd& norm_field_weights) {
+      auto& images = arena.slab (size (n), false);
+      if (images.field_slab != ssize_t (n) || images.field_weights.size() != norm_field_weights.size() || images.field_weights != norm_field_weights) {
+        Timings::Phase phase ("field evaluation");
+        TiledLoop (NormField (norm_field_weights, transform, basis_function, regions, offset (n)), images.norm_field_image);
+        images.field_weights = norm_field_weights;
+        images.field_slab = n;
+      }
+      norm_field_image = images.norm_field_image;
+      summed_log = images.summed_log;
+    }
+
+    void load (size_t n, const Eigen::VectorXd& norm_field_weights) {
+      load_tissue (n);
+      load_field (n, norm_field_weights);
+    }
+
+    // Release the input images (e.g. so that in-place modifications are committed to file)
+    void release_inputs () { input_images.clear(); }
+
+    // Largest and root-mean-square absolute log-ratio of the stored to the original (positive)
+    // tissue values, over all values loaded so far (zero for single precision storage)
+    double max_rounding_error () const { return rounding_error.max; }
+    double rms_rounding_error () const { return rounding_error.count ? std::sqrt (rounding_error.sum_sq / rounding_error.count) : 0.0; }
+
+    // The scratch images of the slab last loaded (with the tissue components in
+    // combined_tissue if stored in single precision, or in reduced_tissue otherwise)
+    ImageType combined_tissue, norm_field_image, summed_log;
+    Image<uint16_t> reduced_tissue;
+
+    ScratchArena arena;
+
+  protected:
+    // Error introduced by rounding the tissue values, accumulated by each thread and
+    // combined on destruction of its copy
+    struct RoundingError { NOMEMALIGN
+      RoundingError () : max (0.0), sum_sq (0.0), count (0) { }
+      double max, sum_sq;
+      size_t count;
+      std::mutex mutex;
+    } rounding_error;
+
+    template <class Storage>
+    struct LoadTissue { MEMALIGN (LoadTissue<Storage>)
+      LoadTissue (const TissueView& input, ssize_t slab_offset, RoundingError& shared) :
+        input (input), slab_offset (slab_offset), shared (shared), max (0.0), sum_sq (0.0), count (0) { }
+      LoadTissue (const LoadTissue& that) :
+        input (that.input), slab_offset (that.slab_offset), shared (that.shared), max (0.0), sum_sq (0.0), count (0) { }
+      ~LoadTissue () {
+        std::lock_guard<std::mutex> lock (shared.mutex);
+        shared.max = std::max (shared.max, max);
+        shared.sum_sq += sum_sq;
+        shared.count += count;
+      }
+
+      FORCE_INLINE void operator () (TissueImageType<Storage>& comb) {
+        input.set_voxel (comb, slab_offset);
+        const float value = std::max<float>(input.value (), 0.f);
+        comb.value() = Storage::narrow (value);
+        if (!std::is_same<Storage, Float32Storage>::value && value > 0.f && std::isfinite (value)) {
+          const double error = std::abs (std::log (double (Storage::widen (comb.value())) / value));
+          max = std::max (max, error);
+          sum_sq += error * error;
+          ++count;
+        }
+      }
+
+      TissueView input;
+      ssize_t slab_offset;
+      RoundingError& shared;
+      double max, sum_sq;
+      size_t count;
+    };
+
+    template <class Storage>
+    void load_tissue (TissueImageType<Storage>& combined, size_t n, ProgressBar* progress) {
+      for (size_t j = 0; j < input_images.size(); ++j) {
+        if (progress)
+          ++(*progress);
+        combined.index (3) = j;
+        TiledLoop (LoadTissue<Storage> (input_images[j], offset (n), rounding_error), combined);
+      }
+      combined.index (3) = 0;
+    }
+
+    const TissuePrecision storage_precision;
+    vector<TissueView> input_images;
+    Transform transform;
+    struct PolyBasisFunction basis_function;
+    FieldRegions regions;
+    std::pair<ssize_t, ssize_t> z_range;
+    const ssize_t depth;
+
+    // Depth of slab n (only the last slab may be thinner than the others)
+    ssize_t size (size_t n) const { return std::min (depth, z_range.second - offset (n)); }
+};
+
+// Sizes (in bytes) of the scratch buffers of the fit, for the given storage precision
+struct ScratchSizes { NOMEMALIGN
+  ScratchSizes (const Header& header_3D, size_t n_tissue_types, size_t num_voxels, TissuePrecision precision) :
+    // tissue components (at the storage precision), normalisation field and summed_log for each voxel in a slice
+    slice (header_3D.size(0) * header_3D.size(1) * (n_tissue_types * (precision == TissuePrecision::Float32 ? sizeof (ValueType) : sizeof (uint16_t)) + 2 * sizeof (ValueType))),
+    // initial, current and previous processing masks over the whole image
+    masks (3 * ((voxel_count (header_3D) + 7) / 8)),
+    // summed_log values within the mask, held in memory for exact quartiles
+    quartiles (num_voxels * sizeof (float)) { }
+
+  // Total size if all nz slices are held in memory
+  size_t in_memory (ssize_t nz) const { return masks + nz * slice + quartiles; }
+
+  size_t slice, masks, quartiles;
+};
+
+// Function to determine the depth of the slabs in which the tissue components are processed,
+// such that the scratch images fit within the memory limit (in bytes; zero for no limit)
+// (nz being the number of slices to be processed)
+ssize_t SlabDepth(const Header& header_3D, ssize_t nz, size_t n_tissue_types, size_t num_voxels, size_t memory_limit, TissuePrecision precision = TissuePrecision::Float32){
+  if (!memory_limit)
+    return nz;
+  const ScratchSizes bytes (header_3D, n_tissue_types, num_voxels, precision);
+  if (bytes.in_memory (nz) <= memory_limit)
+    return nz;
+  if (memory_limit < bytes.masks + bytes.slice) {
+    WARN ("memory limit is too low to hold even a single slice of the tissue components; processing one slice at a time");
+    return 1;
+  }
+  const ssize_t max_depth = (memory_limit - bytes.masks) / bytes.slice;
+  // The scratch images for the slab depth and for the (thinner) last slab are both kept for
+  // the whole fit, so choose the largest depth for which both fit within the limit
+  for (ssize_t depth = max_depth; depth > 1; --depth) {
+    if (depth + nz % depth <= max_depth)
+      return depth;
+  }
+  return 1;
+};
+
+// Nominal per-thread costs used to estimate the run time of the fit (its order of magnitude only)
+#define PLAN_NS_PER_TISSUE_VALUE 1.0
+#define PLAN_NS_PER_BASIS_PRODUCT 0.5
+#define PLAN_READ_MB_PER_SECOND 500.0
+
+// The execution strategy of the fit, chosen before any tissue components are loaded, and the
+// resulting estimate of the peak memory use and run time
+struct FitPlan { NOMEMALIGN
+  TissuePrecision precision;
+  ssize_t slab_depth;
+  MemoryPlan estimate;
+};
+
+// Function to choose the execution strategy within the memory limit (in bytes; zero for no limit):
+// tissue components held in memory at the requested precision if they fit, otherwise (unless the
+// precision was set explicitly, i.e. requested_precision is non-negative) in memory at 16 bits per
+// value (bfloat16, which preserves the range of the values) if they fit, otherwise streamed from
+// the input images in slabs at the requested precision. The number of voxels in the mask is that
+// of the initial mask (an upper bound on that of the refined mask), within the nz slices processed.
+FitPlan PlanFit(const vector<TissueView>& input_images, const vector<Header>& output_headers, const vector<std::string>& output_filenames,
+                const Header& header_3D, ssize_t nz, size_t num_voxels, const FieldRegions& regions, const struct PolyBasisFunction& basis_function,
+                size_t max_iter, bool sharded, size_t memory_limit, int requested_precision){
+  const size_t n_tissue_types = input_images.size();
+  FitPlan plan { requested_precision < 0 ? TissuePrecision::Float32 : TissuePrecision (requested_precision), nz, MemoryPlan() };
+  // Scratch images backed by files are not limited by the memory available
+  const std::string& scratch_dir (ScratchFiles::directory());
+  if (memory_limit && scratch_dir.empty()) {
+    if (requested_precision < 0 && ScratchSizes (header_3D, n_tissue_types, num_voxels, plan.precision).in_memory (nz) > memory_limit &&
+        ScratchSizes (header_3D, n_tissue_types, num_voxels, TissuePrecision::BFloat16).in_memory (nz) <= memory_limit)
+      plan.precision = TissuePrecision::BFloat16;
+    plan.slab_depth = SlabDepth (header_3D, nz, n_tissue_types, num_voxels, memory_limit, plan.precision);
+  }
+  const bool in_memory = plan.slab_depth >= nz;
+  const size_t num_slabs = (nz + plan.slab_depth - 1) / plan.slab_depth;
+  plan.estimate.strategy = in_memory ?
+      "tissue components held in " + (scratch_dir.size() ? "memory-mapped scratch files in \"" + scratch_dir + "\"" : std::string ("memory")) +
+          " (" + std::string (precision_choices[int (plan.precision)]) + ")" :
+      "tissue components streamed from the input images in " + str(num_slabs) + " slabs of " + str(plan.slab_depth) + " slices (" + std::string (precision_choices[int (plan.precision)]) + ")";
+  if (requested_precision < 0 && plan.precision != TissuePrecision::Float32)
+    plan.estimate.strategy += ", reduced precision selected to fit within the memory limit";
+
+  // Buffers held during the fit
+  const ScratchSizes bytes (header_3D, n_tissue_types, num_voxels, plan.precision);
+  auto add_scratch = [&] (const std::string& description, size_t size) {
+    if (scratch_dir.size())
+      plan.estimate.add_mapped ("scratch file: " + description, size);
+    else
+      plan.estimate.add (description, size);
+  };
+  add_scratch ("processing masks", bytes.masks);
+  if (regions.labels.valid())
+    add_scratch ("label region indices", voxel_count (header_3D) * sizeof (uint32_t));
+  const ssize_t last_depth = nz % plan.slab_depth;
+  add_scratch ("tissue components, field and summed_log (" + str(plan.slab_depth) + (last_depth ? " + " + str(last_depth) : std::string()) + " slices)",
+               (plan.slab_depth + (in_memory ? 0 : last_depth)) * bytes.slice);
+  if (in_memory && !sharded)
+    plan.estimate.add ("summed_log values for exact quartiles", bytes.quartiles);
+  const size_t n_threads = ThreadPool::shared().size();
+  const size_t n_weights = regions.size() * basis_function.n_basis_vecs;
+  plan.estimate.add ("normal equations (" + str(n_threads) + " threads)", (n_threads + 1) * (n_weights + 1) * basis_function.n_basis_vecs * sizeof (double));
+  if (output_headers.size())
+    add_scratch ("output image buffer", voxel_count (output_headers.back()) * sizeof (ValueType));
+
+  // Image files
+  size_t input_bytes = 0;
+  std::set<std::string> input_names;
+  for (const auto& view : input_images) {
+    if (input_names.insert (view.image.name()).second) {
+      // (compressed images are identified by the file decompressed, rather than by the temporary file)
+      const std::string path = ParallelGZ::source (view.image.name());
+      plan.estimate.add_image ("input image \"" + Path::basename (path) + "\"", view.image, path);
+      input_bytes += voxel_count (view.image) * view.image.datatype().bytes();
+    }
+  }
+  for (size_t o = 0; o < output_headers.size(); ++o)
+    plan.estimate.add_image ("output image \"" + Path::basename (output_filenames[o]) + "\"", output_headers[o], output_filenames[o]);
+
+  // Passes over the data: the input images are read once to refine the mask, and then either once
+  // to load the tissue components, or at every pass if streamed; the per-voxel work is shared by all threads
+  const double slab_fraction = double (nz) / header_3D.size(2);
+  const double read_time = slab_fraction * input_bytes / (PLAN_READ_MB_PER_SECOND * (1 << 20));
+  const double n_voxels = double (voxel_count (header_3D)) * slab_fraction;
+  const double value_time = 1.0e-9 * PLAN_NS_PER_TISSUE_VALUE * n_voxels * n_tissue_types / n_threads;
+  const double basis_time = 1.0e-9 * PLAN_NS_PER_BASIS_PRODUCT * num_voxels * basis_function.n_basis_vecs * basis_function.n_basis_vecs / n_threads;
+  const double field_time = 1.0e-9 * PLAN_NS_PER_BASIS_PRODUCT * n_voxels * basis_function.n_basis_vecs / n_threads;
+  const double stream_time = in_memory ? 0.0 : read_time;
+  plan.estimate.add_pass ("mask refinement", read_time + value_time);
+  if (in_memory)
+    plan.estimate.add_pass ("loading tissue components", read_time + value_time);
+  // per iteration: summed_log and outlier rejection, balance iterations (at most), and field solve and evaluation
+  const size_t passes_per_iteration = 2 + DEFAULT_BALANCE_MAXITER_VALUE + 1;
+  plan.estimate.add_pass ("up to " + str(max_iter) + " iterations of " + str(passes_per_iteration) + " passes",
+                          max_iter * (passes_per_iteration * (value_time + stream_time) + basis_time + field_time));
+  plan.estimate.add_pass ("output", read_time + field_time + value_time);
+  return plan;
+};
+
+// Function to invoke the kernel specialised for the storage format and number of tissue types
+// on the tissue components of the slab last loaded (passed as the first argument of the kernel)
+template <template <int, class> class Kernel, class... Args>
+FORCE_INLINE void RunSlabKernel(TissueSlabs& slabs, Args&&... args){
+  switch (slabs.precision()) {
+    case TissuePrecision::Float32: RunTissueKernel<Kernel, Float32Storage> (slabs.n_tissue_types(), slabs.combined_tissue, std::forward<Args> (args)...); break;
+    case TissuePrecision::Float16: RunTissueKernel<Kernel, Float16Storage> (slabs.n_tissue_types(), slabs.reduced_tissue, std::forward<Args> (args)...); break;
+    case TissuePrecision::BFloat16: RunTissueKernel<Kernel, BFloat16Storage> (slabs.n_tissue_types(), slabs.reduced_tissue, std::forward<Args> (args)...); break;
+  }
+};
+
+// Struct calculating the summed_log values
+template <int NumTissues, class Storage>
+struct SummedLog { MEMALIGN (SummedLog)
+  SummedLog (const Eigen::VectorXd& balance_factors) : balance_factors (balance_factors) { }
+
+  FORCE_INLINE void operator () (ImageType& summed_log, TissueImageType<Storage>& combined_tissue, ImageType& norm_field_image) {
+    AllocStats::HotRegion hot ("SummedLog");
+    summed_log.value() = std::log (balance_factors.dot (TissueValues<NumTissues, Storage> (combined_tissue).template cast<double>()) / norm_field_image.value());
+  }
+
+  static void run (TissueImageType<Storage>& combined_tissue, ImageType& summed_log, ImageType& norm_field_image, const Eigen::VectorXd& balance_factors) {
+    TiledLoop (SummedLog (balance_factors), summed_log, combined_tissue, norm_field_image);
+  }
+
+  TissueVector<NumTissues> balance_factors;
 };
 
 // Function to define the output values at the beginning of the run () function
 ImageType DefineOutput(vector<std::string> output_filenames, vector<Header> output_headers) {
   ImageType output_image;
   for (size_t j = 0; j < output_filenames.size(); ++j) {
-     output_image = ImageType::scratch (output_headers[j], output_filenames[j]);
+     output_image = scratch_image<ValueType> (output_headers[j], output_filenames[j]);
   }
 return output_image;
 };
 
 // Function to perform outlier rejection
-size_t OutlierRejection(float outlier_range, MaskType& mask, MaskType& initial_mask, Header header_3D, ImageType combined_tissue, ImageType norm_field_image, Eigen::VectorXd balance_factors, size_t num_voxels){
-
-    auto summed_log = ImageType::scratch (header_3D, "Log of summed tissue volumes");
-    ThreadedLoop (summed_log, 0, 3).run (SummedLog(combined_tissue.size(3), balance_factors), summed_log, combined_tissue, norm_field_image);
-    threaded_copy (initial_mask, mask);
-
-    vector<float> summed_log_values;
-    summed_log_values.reserve (num_voxels);
-    for (auto i = Loop (0, 3) (mask, summed_log); i; ++i) {
-      if (mask.value())
-        summed_log_values.push_back (summed_log.value());
+// (num_voxels and the returned count refer to the mask over all shards)
+size_t OutlierRejection(float outlier_range, MaskType& mask, MaskType& initial_mask, TissueSlabs& slabs, const Eigen::VectorXd& norm_field_weights, const Eigen::VectorXd& balance_factors, size_t num_voxels, Shard& shard){
+    Timings::Phase phase ("OutlierRejection");
+
+    tiled_copy (initial_mask, mask);
+
+    // If the tissue components are held in memory by a single process, all summed_log values
+    // within the mask are gathered to compute the quartiles exactly; otherwise, they are
+    // estimated from a sketch accumulated over the slabs (and shards)
+    const bool exact = slabs.in_memory() && !shard.active();
+    vector<float>& summed_log_values (slabs.arena.values());
+    QuantileSketch summed_log_sketch;
+    if (exact)
+      slabs.arena.reserve_values (num_voxels);
+
+    for (size_t n = 0; n < slabs.num_slabs(); ++n) {
+      slabs.load (n, norm_field_weights);
+      RunSlabKernel<SummedLog> (slabs, slabs.summed_log, slabs.norm_field_image, balance_factors);
+      for (auto i = Loop (0, 3) (slabs.summed_log); i; ++i) {
+        AssignSlabPos (slabs.summed_log, mask, slabs.offset (n));
+        if (mask.value()) {
+          if (exact)
+            summed_log_values.push_back (slabs.summed_log.value());
+          else
+            summed_log_sketch.insert (slabs.summed_log.value());
+        }
+      }
     }
 
-    num_voxels = summed_log_values.size();
-
-    auto lower_quartile_it = summed_log_values.begin() + std::round ((float)num_voxels * 0.25f);
-    std::nth_element (summed_log_values.begin(), lower_quartile_it, summed_log_values.end());
-    float lower_quartile = *lower_quartile_it;
-    auto upper_quartile_it = summed_log_values.begin() + std::round ((float)num_voxels * 0.75f);
-    std::nth_element (lower_quartile_it, upper_quartile_it, summed_log_values.end());
-    float upper_quartile = *upper_quartile_it;
+    float lower_quartile, upper_quartile;
+    if (exact) {
+      num_voxels = summed_log_values.size();
+
+      auto lower_quartile_it = summed_log_values.begin() + std::round ((float)num_voxels * 0.25f);
+      std::nth_element (summed_log_values.begin(), lower_quartile_it, summed_log_values.end());
+      lower_quartile = *lower_quartile_it;
+      auto upper_quartile_it = summed_log_values.begin() + std::round ((float)num_voxels * 0.75f);
+      std::nth_element (lower_quartile_it, upper_quartile_it, summed_log_values.end());
+      upper_quartile = *upper_quartile_it;
+    } else {
+      ReduceOverShards (shard, summed_log_sketch);
+      num_voxels = summed_log_sketch.size();
+      lower_quartile = summed_log_sketch.quantile (0.25);
+      upper_quartile = summed_log_sketch.quantile (0.75);
+    }
     float lower_outlier_threshold = lower_quartile - outlier_range * (upper_quartile - lower_quartile);
     float upper_outlier_threshold = upper_quartile + outlier_range * (upper_quartile - lower_quartile);
 
-    for (auto i = Loop (0, 3) (mask, summed_log); i; ++i) {
-      if (mask.value()) {
-        if (summed_log.value() < lower_outlier_threshold || summed_log.value() > upper_outlier_threshold) {
-          mask.value() = 0;
-          num_voxels--;
+    size_t num_rejected = 0;
+    for (size_t n = 0; n < slabs.num_slabs(); ++n) {
+      if (!slabs.in_memory()) {
+        slabs.load (n, norm_field_weights);
+        RunSlabKernel<SummedLog> (slabs, slabs.summed_log, slabs.norm_field_image, balance_factors);
+      }
+      for (auto i = Loop (0, 3) (slabs.summed_log); i; ++i) {
+        AssignSlabPos (slabs.summed_log, mask, slabs.offset (n));
+        if (mask.value()) {
+          if (slabs.summed_log.value() < lower_outlier_threshold || slabs.summed_log.value() > upper_outlier_threshold) {
+            mask.value() = 0;
+            num_rejected++;
+          }
         }
       }
     }
 
-return num_voxels;
+return num_voxels - SumOverShards (shard, num_rejected);
 };
 
-// Function to compute the Choleski decompostion based on
-// an N by n Eigen matrix and an N by 1 Eigen vector
-Eigen::VectorXd Choleski(Eigen::MatrixXd X, Eigen::VectorXd y) {
-   Eigen::MatrixXd M (X.cols(), X.cols());
-   Eigen::VectorXd alpha (X.cols());
-   M = X.transpose()*X;
-   alpha = X.transpose()*y;
-   Eigen::VectorXd res = M.llt().solve (alpha);
-return res;
-};
-
-// Function to refine the mask
+// Function to refine the mask (within the range of slices z_range; the mask is cleared elsewhere)
 template<class InType>
-void RefinedMask(InType input_images, MaskType& initial_mask, MaskType orig_mask, ProgressBar& input_progress, ImageType summed){
-    for (size_t j = 0; j < input_images.size(); ++j) {
+void RefinedMask(const InType& input_images, MaskType& initial_mask, MaskType orig_mask, std::pair<ssize_t, ssize_t> z_range, ProgressBar& input_progress){
+    Timings::Phase phase ("RefinedMask");
+    struct SumPositive {
+      SumPositive (const InType& input_images, std::pair<ssize_t, ssize_t> z_range) : input_images (input_images), z_range (z_range) { }
+      FORCE_INLINE void operator () (MaskType& orig, MaskType& refined) {
+        if (orig.index(2) < z_range.first || orig.index(2) >= z_range.second) {
+          refined.value() = false;
+          return;
+        }
+        float sum = 0.f;
+        for (auto& in : input_images) {
+          in.set_voxel (orig);
+          sum += in.value();
+        }
+        refined.value() = ( std::isfinite(sum) && sum > 0.f && orig.value() );
+      }
+      InType input_images;
+      std::pair<ssize_t, ssize_t> z_range;
+    };
+    for (size_t j = 0; j < input_images.size(); ++j)
       input_progress++;
-      ThreadedLoop(summed).run([](decltype(summed)& sum, decltype(input_images[0])& in){sum.value()+=in.value();}, summed, input_images[j]);
+    // the slices within z_range are processed as they become available in the input images (if compressed, see ParallelGZ)
+    vector<std::string> inputs;
+    for (const auto& in : input_images)
+      inputs.push_back (in.image.name());
+    const SumPositive sum_positive (input_images, z_range);
+    TiledLoopSlices ({ 0, z_range.first }, nullptr, sum_positive, orig_mask, initial_mask);
+    TiledLoopAsAvailable (inputs, z_range, nullptr, sum_positive, orig_mask, initial_mask);
+    TiledLoopSlices ({ z_range.second, orig_mask.size(2) }, nullptr, sum_positive, orig_mask, initial_mask);
+};
+
+// Struct accumulating the normal equations for the tissue balance factors
+template <int NumTissues, class Storage>
+struct BalFactEquations { MEMALIGN (BalFactEquations)
+  BalFactEquations (SharedNormalEquations& shared, const MaskType& mask, ssize_t slab_offset) : equations (shared), mask (mask), slab_offset (slab_offset) { }
+
+  FORCE_INLINE void operator () (TissueImageType<Storage>& combined_tissue, ImageType& norm_field_image) {
+    AllocStats::HotRegion hot ("BalFactEquations");
+    AssignSlabPos (combined_tissue, mask, slab_offset);
+    if (mask.value()) {
+      const TissueVector<NumTissues> x = TissueValues<NumTissues, Storage> (combined_tissue).template cast<double>() / double (norm_field_image.value());
+      equations.XtX.noalias() += x * x.transpose();
+      equations.Xty += x;
+      ++equations.count;
     }
-ThreadedLoop(summed).run([](ImageType& summed, MaskType& initial_mask, MaskType& refined){refined.value() = ( std::isfinite(float(summed.value())) && summed.value() > 0.f && initial_mask.value() );}, summed, orig_mask, initial_mask);
+  }
+
+  static void run (TissueImageType<Storage>& combined_tissue, SharedNormalEquations& shared, const MaskType& mask, ImageType& norm_field_image, ssize_t slab_offset) {
+    TiledLoop (BalFactEquations (shared, mask, slab_offset), combined_tissue, norm_field_image);
+  }
+
+  LocalNormalEquations<NumTissues> equations;
+  MaskType mask;
+  ssize_t slab_offset;
 };
 
 // Function to solve for tissue balance factors
-void BalFactSolver(Eigen::MatrixXd& X, Eigen::VectorXd& y, MaskType mask, ImageType combined_tissue, ImageType norm_field_image, size_t n_tissue_types){
- uint32_t index = 0;
-   for (auto i = Loop (0, 3) (mask, combined_tissue, norm_field_image); i; ++i) {
-      if (mask.value()) {
-        for (size_t j = 0; j < n_tissue_types; ++j) {
-          combined_tissue.index (3) = j;
-          X (index, j) = combined_tissue.value() / norm_field_image.value();
-        }
-      ++index;
-      }
-   }
+Eigen::VectorXd BalFactSolver(TissueSlabs& slabs, const MaskType& mask, const Eigen::VectorXd& norm_field_weights, Shard& shard){
+  Timings::Phase phase ("balance solve");
+  SharedNormalEquations equations (slabs.n_tissue_types());
+  for (size_t n = 0; n < slabs.num_slabs(); ++n) {
+    slabs.load (n, norm_field_weights);
+    RunSlabKernel<BalFactEquations> (slabs, equations, mask, slabs.norm_field_image, slabs.offset (n));
+  }
+  ReduceOverShards (shard, equations);
+  return equations.solve();
 };
 
-// Function to solve for normalisation field weights in the log domain
-void NormWeightsLog(Eigen::MatrixXd& norm_field_basis, Eigen::VectorXd& y, Eigen::VectorXd balance_factors, struct PolyBasisFunction basis_function, MaskType mask, ImageType& combined_tissue, Transform transform, size_t n_tissue_types, float log_norm_value){
-    uint32_t index = 0;
-    for (auto i = Loop (0, 3) (mask, combined_tissue); i; ++i) {
-      if (mask.value()) {
-        Eigen::Vector3 vox (mask.index(0), mask.index(1), mask.index(2));
-        Eigen::Vector3 pos = transform.voxel2scanner * vox;
-        norm_field_basis.row (index) = basis_function (pos).col(0);
+// Struct accumulating the normal equations for the normalisation field weights in the log domain
+template <int NumTissues, class Storage>
+struct NormWeightsEquations { MEMALIGN (NormWeightsEquations)
+  NormWeightsEquations (SharedNormalEquations& shared, const MaskType& mask, const FieldRegions& regions, const Eigen::VectorXd& balance_factors, const struct PolyBasisFunction& basis_function,
+                        const Transform& transform, float log_norm_value, ssize_t slab_offset) :
+    equations (shared), mask (mask), regions (regions), balance_factors (balance_factors), basis_function (basis_function), transform (transform), log_norm_value (log_norm_value), slab_offset (slab_offset) { }
+
+  FORCE_INLINE void operator () (TissueImageType<Storage>& combined_tissue) {
+    AllocStats::HotRegion hot ("NormWeightsEquations");
+    AssignSlabPos (combined_tissue, mask, slab_offset);
+    if (mask.value()) {
+      Eigen::Vector3 vox (mask.index(0), mask.index(1), mask.index(2));
+      Eigen::Vector3 pos = basis_function.position (transform, vox);
+      const PolyBasisFunction::Basis basis = basis_function (pos);
+      const double y = std::log (balance_factors.dot (TissueValues<NumTissues, Storage> (combined_tissue).template cast<double>())) - log_norm_value;
+      // Each region only contributes to its own diagonal block of the normal equations
+      const size_t offset = regions.weights_offset (mask.index(0), mask.index(1), mask.index(2), basis.size());
+      equations.XtX.block (0, offset, basis.size(), basis.size()).template selfadjointView<Eigen::Lower>().rankUpdate (basis);
+      equations.Xty.segment (offset, basis.size()) += y * basis;
+      ++equations.count;
+    }
+  }
 
-        double sum = 0.0;
-        for (size_t j = 0; j < n_tissue_types; ++j) {
-          combined_tissue.index(3) = j;
-          sum += balance_factors(j) * combined_tissue.value() ;
-        }
-        y (index++) = std::log(sum) - log_norm_value;
+  static void run (TissueImageType<Storage>& combined_tissue, SharedNormalEquations& shared, const MaskType& mask, const FieldRegions& regions, const Eigen::VectorXd& balance_factors,
+                   const struct PolyBasisFunction& basis_function, const Transform& transform, float log_norm_value, ssize_t slab_offset) {
+    TiledLoop (NormWeightsEquations (shared, mask, regions, balance_factors, basis_function, transform, log_norm_value, slab_offset), combined_tissue);
+  }
+
+  LocalNormalEquations<Eigen::Dynamic> equations;
+  MaskType mask;
+  FieldRegions regions;
+  TissueVector<NumTissues> balance_factors;
+  struct PolyBasisFunction basis_function;
+  Transform transform;
+  float log_norm_value;
+  ssize_t slab_offset;
+};
+
+// Function to solve for normalisation field weights in the log domain, for all regions jointly:
+// the normal equations are block-diagonal, with one block per region. Also provides the
+// root-mean-square change of the log-domain field within the mask from the previous weights.
+Eigen::VectorXd NormWeightsLog(TissueSlabs& slabs, const MaskType& mask, const FieldRegions& regions, const Eigen::VectorXd& balance_factors, const struct PolyBasisFunction& basis_function, const Transform& transform, float log_norm_value, Shard& shard,
+                               const Eigen::VectorXd& previous_weights, double& field_change){
+  Timings::Phase phase ("field solve");
+  SharedNormalEquations equations (regions.size() * basis_function.n_basis_vecs, basis_function.n_basis_vecs);
+  for (size_t n = 0; n < slabs.num_slabs(); ++n) {
+    slabs.load_tissue (n);
+    RunSlabKernel<NormWeightsEquations> (slabs, equations, mask, regions, balance_factors, basis_function, transform, log_norm_value, slabs.offset (n));
+  }
+  ReduceOverShards (shard, equations);
+  const Eigen::VectorXd weights = equations.solve();
+  field_change = equations.rms_change (weights - previous_weights);
+  return weights;
+};
+
+// Function to write the normalisation field weights and tissue balance factors to file, for use with -init
+void ExportFit(const std::string& path, int order, const struct PolyBasisFunction& basis_function, size_t n_regions, const Eigen::VectorXd& norm_field_weights, const Eigen::VectorXd& balance_factors){
+  File::OFStream out (path);
+  out.precision (17);
+  out << "mtnormalise fit\n";
+  out << "order: " << order << "\n";
+  out << "planar: " << basis_function.planar << "\n";
+  out << "regions: " << n_regions << "\n";
+  out << "balance_factors: " << balance_factors.transpose() << "\n";
+  out << "weights: " << norm_field_weights.transpose() << "\n";
+};
+
+// Function to read the normalisation field weights and tissue balance factors written by ExportFit(),
+// checking that these are compatible with the current settings
+void ImportFit(const std::string& path, int order, const struct PolyBasisFunction& basis_function, size_t n_regions, Eigen::VectorXd& norm_field_weights, Eigen::VectorXd& balance_factors){
+  std::ifstream in (path);
+  std::string line;
+  if (!std::getline (in, line) || line != "mtnormalise fit")
+    throw Exception ("file \"" + path + "\" does not contain an mtnormalise fit");
+  std::map<std::string, std::string> entries;
+  while (std::getline (in, line)) {
+    const auto colon = line.find (':');
+    if (colon != std::string::npos)
+      entries[line.substr (0, colon)] = line.substr (colon+1);
+  }
+  for (const char* key : { "order", "planar", "regions", "balance_factors", "weights" })
+    if (entries.find (key) == entries.end())
+      throw Exception ("entry \"" + std::string (key) + "\" missing from mtnormalise fit in file \"" + path + "\"");
+
+  if (to<int> (entries["order"]) != order || to<int> (entries["planar"]) != int (basis_function.planar) || to<size_t> (entries["regions"]) != n_regions)
+    throw Exception ("mtnormalise fit in file \"" + path + "\" does not match the current -order, -labels or -slicewise settings");
+
+  auto parse = [&] (const std::string& key, Eigen::VectorXd& values) {
+    std::istringstream stream (entries[key]);
+    for (ssize_t n = 0; n < values.size(); ++n)
+      if (!(stream >> values[n]))
+        throw Exception ("error reading " + key + " of mtnormalise fit in file \"" + path + "\" (wrong number of tissue types?)");
+  };
+  parse ("balance_factors", balance_factors);
+  parse ("weights", norm_field_weights);
+};
+
+// Function to transform the weights of 3D fields defined in the scanner space of other images into
+// the scanner space of the current images, given the transform T mapping scanner positions of the
+// current images onto those of the other images. Polynomials are closed under affine transformation,
+// so the weights of the fields f(T p) are obtained exactly (to numerical precision) by fitting them
+// at a grid of sample positions spanning the image.
+Eigen::VectorXd TransformWeights(const Eigen::VectorXd& weights, struct PolyBasisFunction basis_function, const transform_type& T, const Transform& transform, const Header& header_3D){
+  const size_t n_basis_vecs = basis_function.n_basis_vecs;
+  const size_t n_regions = weights.size() / n_basis_vecs;
+  const int grid = 5;
+  Eigen::MatrixXd design (grid*grid*grid, n_basis_vecs), values (grid*grid*grid, n_regions);
+  size_t row = 0;
+  for (int k = 0; k < grid; ++k)
+    for (int j = 0; j < grid; ++j)
+      for (int i = 0; i < grid; ++i, ++row) {
+        const Eigen::Vector3 vox (i * (header_3D.size(0)-1) / double (grid-1), j * (header_3D.size(1)-1) / double (grid-1), k * (header_3D.size(2)-1) / double (grid-1));
+        const Eigen::Vector3 pos = transform.voxel2scanner * vox;
+        design.row (row) = basis_function (pos).transpose();
+        const PolyBasisFunction::Basis other_basis = basis_function (T * pos);
+        for (size_t r = 0; r < n_regions; ++r)
+          values (row, r) = other_basis.dot (weights.segment (r * n_basis_vecs, n_basis_vecs));
       }
+  const Eigen::MatrixXd solution = design.colPivHouseholderQr().solve (values);
+  Eigen::VectorXd transformed (weights.size());
+  for (size_t r = 0; r < n_regions; ++r)
+    transformed.segment (r * n_basis_vecs, n_basis_vecs) = solution.col (r);
+  return transformed;
+};
+
+// Function to compute the key of the cache entry for a fit: a hash of the contents of the tissue
+// components, mask and label image, and of the settings of all options affecting the fit
+std::string CacheKey(const vector<TissueView>& input_images, MaskType orig_mask, FieldRegions regions, const std::string& settings){
+  ContentHash hash;
+  hash.update (settings);
+  auto update_geometry = [&] (const Header& header) {
+    hash.update_value (header.ndim());
+    for (size_t axis = 0; axis < header.ndim(); ++axis) {
+      hash.update_value (header.size (axis));
+      hash.update_value (header.stride (axis));
     }
+    for (size_t axis = 0; axis < 3; ++axis)
+      hash.update_value (header.spacing (axis));
+    hash.update (header.transform().matrix().data(), header.transform().matrix().size() * sizeof (default_type));
+  };
+  for (const auto& input : input_images) {
+    hash.update_value (input.first_volume);
+    hash.update_value (input.n_vols);
+    // (with -multitissue, the views of all volumes share the image of the first)
+    if (input.first_volume)
+      continue;
+    update_geometry (input.image);
+    update_image (hash, input.image);
+  }
+  update_geometry (orig_mask);
+  update_image (hash, orig_mask);
+  if (regions.labels.valid())
+    update_image (hash, regions.labels);
+  return hash.hex();
+};
+
+// Function to store the result of a fit in the cache. The fit file is written last (and renamed
+// into place), so that an entry is only ever found once complete.
+void SaveCachedFit(const std::string& entry, MaskType& mask, int order, const struct PolyBasisFunction& basis_function, size_t n_regions, const Eigen::VectorXd& norm_field_weights, const Eigen::VectorXd& balance_factors){
+  if (Path::exists (entry + "-mask.mif"))
+    File::unlink (entry + "-mask.mif");
+  {
+    auto mask_output = MaskType::create (entry + "-mask.mif", mask);
+    tiled_copy (mask, mask_output);
+  }
+  const std::string temp_name = entry + ".fit.tmp" + str(getpid());
+  ExportFit (temp_name, order, basis_function, n_regions, norm_field_weights, balance_factors);
+  if (std::rename (temp_name.c_str(), (entry + ".fit").c_str()))
+    throw Exception ("error adding fit to cache \"" + entry + ".fit\": " + strerror (errno));
 };
 
 // Function to compute log-norm scale parameter
-void LogScale(double& lognorm_scale, uint32_t vox_count, MaskType mask, ImageType norm_field_log){
-  if (vox_count) {
-    struct LogNormScale {
-      LogNormScale (double& lognorm_scale, uint32_t num_voxels) : lognorm_scale (lognorm_scale), num_voxels (num_voxels) { }
-      FORCE_INLINE void operator () (decltype(mask) mask_in, decltype(norm_field_log) norm_field_lg) { if (mask_in.value ()){ lognorm_scale += norm_field_lg.value (); } lognorm_scale = std::exp(lognorm_scale / (double)num_voxels); }
-      double& lognorm_scale;
-      uint32_t num_voxels;
-   };
-   ThreadedLoop (mask).run (LogNormScale(lognorm_scale, vox_count), mask, norm_field_log);
+// (geometric mean of normalisation field within the mask)
+double LogScale(TissueSlabs& slabs, MaskType mask, const Eigen::VectorXd& norm_field_weights, size_t vox_count, Shard& shard){
+  if (!vox_count)
+    return 0.0;
+  double sum_log = 0.0;
+  for (size_t n = 0; n < slabs.num_slabs(); ++n) {
+    slabs.load_field (n, norm_field_weights);
+    for (auto i = Loop (0, 3) (slabs.norm_field_image); i; ++i) {
+      AssignSlabPos (slabs.norm_field_image, mask, slabs.offset (n));
+      if (mask.value())
+        sum_log += std::log (slabs.norm_field_image.value());
+    }
+  }
+  sum_log = SumOverShards (shard, sum_log);
+  return std::exp (sum_log / double (vox_count));
+};
+
+// Struct copying a slab image into the corresponding region of an image of the whole volume
+struct CopySlab {
+  CopySlab (const ImageType& volume, ssize_t slab_offset) : volume (volume), slab_offset (slab_offset) { }
+  FORCE_INLINE void operator () (ImageType& slab) { AssignSlabPos (slab, volume, slab_offset); volume.value() = slab.value(); }
+  ImageType volume;
+  ssize_t slab_offset;
+};
+
+// Function to gather the final masks of all shards into the mask held by shard 0,
+// each shard writing the mask of its own range of slices to the shared directory
+void GatherMask(Shard& shard, MaskType& mask){
+  const std::string part_name = "mask-" + str(shard.index()) + ".mif";
+  if (shard.index()) {
+    const auto z_range = shard.range (mask.size(2));
+    Header header (mask);
+    header.size(2) = z_range.second - z_range.first;
+    auto part = MaskType::create (shard.path (part_name), header);
+    for (auto i = Loop (0, 3) (part); i; ++i) {
+      AssignSlabPos (part, mask, z_range.first);
+      part.value() = mask.value();
+    }
+  }
+  shard.exchange (std::string());
+  if (shard.index())
+    return;
+  for (size_t s = 1; s < shard.count(); ++s) {
+    const std::string path = shard.path ("mask-" + str(s) + ".mif");
+    {
+      auto part = MaskType::open (path);
+      for (auto i = Loop (0, 3) (part); i; ++i) {
+        AssignSlabPos (part, mask, shard.range (mask.size(2), s).first);
+        mask.value() = part.value();
+      }
+    }
+    File::unlink (path);
+  }
+};
+
+// Function to check that an image can be normalised in place
+void CheckInPlaceSupport(const std::string& path){
+  if (Path::has_suffix (path, ".gz") || Path::has_suffix (path, ".mgz"))
+    throw Exception ("Cannot normalise image \"" + path + "\" in place: compressed images are not supported.");
+  // (the lognorm header entries must be stored along with the scaled data, which only MRtrix images allow)
+  if (!Path::has_suffix (path, ".mif") && !Path::has_suffix (path, ".mih"))
+    throw Exception ("Cannot normalise image \"" + path + "\" in place: only MRtrix format images (.mif/.mih) can record "
+                     "the lognorm header entries of in-place normalisation.");
+};
+
+// Function to update key-value entries in the text header of an existing MRtrix format image.
+// For single-file images (.mif), if the new header does not fit before the data, the data are
+// shifted towards the end of the file (a block at a time, starting from the end) to a new offset,
+// rounded up to a multiple of the page size (which leaves room for later updates in place).
+void UpdateMIFKeyvals(const std::string& path, const KeyValues& entries){
+  std::ifstream in (path, std::ios::in | std::ios::binary);
+  if (!in)
+    throw Exception ("error opening image \"" + path + "\" to update its header: " + strerror (errno));
+
+  std::string line, header;
+  int64_t data_offset = -1;
+  bool end_found = false;
+  while (std::getline (in, line)) {
+    if (line == "END") {
+      end_found = true;
+      break;
+    }
+    const auto colon = line.find (':');
+    if (colon != std::string::npos) {
+      const std::string key = line.substr (0, colon);
+      if (entries.find (key) != entries.end())
+        continue;
+      if (key == "file") {
+        std::istringstream stream (line.substr (colon+1));
+        std::string data_file;
+        stream >> data_file;
+        if (data_file == ".") {
+          // (rewritten below, with the new data offset)
+          stream >> data_offset;
+          continue;
+        }
+      }
+    }
+    header += line + "\n";
+  }
+  in.close();
+  if (!end_found)
+    throw Exception ("error reading header of image \"" + path + "\": END tag not found");
+
+  for (const auto& entry : entries)
+    header += entry.first + ": " + entry.second + "\n";
+
+  if (data_offset < 0) {
+    File::OFStream out (path, std::ios::out | std::ios::binary);
+    out << header << "END\n";
+    return;
   }
+
+  int64_t new_offset = data_offset;
+  auto file_entry = [&] () { return "file: . " + str(new_offset) + "\nEND\n"; };
+  const int64_t page = 4096;
+  while (int64_t (header.size() + file_entry().size()) > new_offset)
+    new_offset = (int64_t (header.size() + file_entry().size()) + page - 1) / page * page;
+
+  std::fstream file (path, std::ios::in | std::ios::out | std::ios::binary);
+  if (new_offset > data_offset) {
+    file.seekg (0, std::ios::end);
+    const int64_t file_size = file.tellg();
+    const int64_t shift = new_offset - data_offset;
+    INFO ("shifting data of image \"" + path + "\" by " + str(shift) + " bytes to make room for its updated header");
+    vector<char> block (1 << 20);
+    for (int64_t block_end = file_size; block_end > data_offset && file; ) {
+      const int64_t block_start = std::max (data_offset, block_end - int64_t (block.size()));
+      file.seekg (block_start);
+      file.read (block.data(), block_end - block_start);
+      file.seekp (block_start + shift);
+      file.write (block.data(), block_end - block_start);
+      block_end = block_start;
+    }
+  }
+  header += file_entry();
+  header.resize (new_offset, '\0');
+  file.seekp (0);
+  file.write (header.data(), header.size());
+  if (!file)
+    throw Exception ("error updating header of image \"" + path + "\": " + strerror (errno));
 };
 
 void run ()
 {
-  if (argument.size() % 2)
+  if (get_options ("pin_threads").size())
+    ThreadPool::pin_threads (true);
+  if (get_options ("huge_pages").size())
+    HugePages::request (true);
+  auto scratch_opt = get_options ("scratch_dir");
+  if (scratch_opt.size())
+    ScratchFiles::set_directory (scratch_opt[0][0]);
+  auto trace_opt = get_options ("trace");
+  if (trace_opt.size())
+    Trace::enable (trace_opt[0][0]);
+  auto timings_opt = get_options ("timings_file");
+  const bool perf_counters = get_options ("perf_counters").size();
+  if (get_options ("timings").size() || timings_opt.size() || perf_counters)
+    Timings::enable (get_options ("timings").size() || (perf_counters && timings_opt.empty()),
+                     timings_opt.size() ? std::string (timings_opt[0][0]) : std::string(), perf_counters);
+  // (reported once all phases, including the output, have completed)
+  struct ReportTimings { NOMEMALIGN
+    ~ReportTimings () {
+      if (std::uncaught_exception())
+        return;
+      try {
+        Timings::report();
+      } catch (Exception& e) {
+        e.display();
+      }
+    }
+  } report_timings;
+
+  const bool inplace = get_options("inplace").size();
+  if (!inplace && argument.size() % 2)
     throw Exception ("The number of arguments must be even, provided as pairs of each input and its corresponding output file.");
+  const size_t arg_step = inplace ? 1 : 2;
+
+  const bool multitissue = get_options("multitissue").size();
+  if (multitissue && argument.size() != arg_step)
+    throw Exception ("The -multitissue option requires a single input image" + std::string (inplace ? "." : " and a single output image."));
 
   const int order = get_option_value<int> ("order", DEFAULT_POLY_ORDER);
-  PolyBasisFunction basis_function (order);
+  PolyBasisFunction basis_function (order, get_options("slicewise").size());
 
-  vector<Adapter::Replicate<ImageType>> input_images;
+  vector<TissueView> input_images;
   vector<Header> output_headers;
   vector<std::string> output_filenames;
   ImageType output_image;
 
-  ProgressBar input_progress ("loading input images", 3*argument.size()/2);
+  const size_t n_progress = multitissue ? 1 + 2*Header::open (argument[0]).size(3) : 3*argument.size()/arg_step;
+  ProgressBar input_progress ("loading input images", n_progress);
 
   // Open input images and prepare output image headers
-  for (size_t i = 0; i < argument.size(); i += 2) {
-    input_progress++;
-    auto image = ImageType::open (argument[i]);
+  {
+    Timings::Phase phase ("loading");
+    for (size_t i = 0; i < argument.size(); i += arg_step) {
+      input_progress++;
+      if (inplace)
+        CheckInPlaceSupport (argument[i]);
+      auto image = open_image<ValueType> (argument[i], inplace, true);
+
+      if (image.ndim () > 4)
+        throw Exception ("Input image \"" + image.name() + "\" contains more than 4 dimensions.");
+      if (multitissue && image.ndim () != 4)
+        throw Exception ("Input image \"" + image.name() + "\" must be 4-dimensional when the -multitissue option is used.");
+
+      // Each tissue component is accessed through a view of the volumes of its image: either
+      // one volume per tissue (-multitissue), or all volumes of the image (which may be 3D)
+      const ssize_t n_vols = image.ndim() > 3 ? image.size(3) : 1;
+      if (multitissue) {
+        for (ssize_t v = 0; v < n_vols; ++v)
+          input_images.emplace_back (image, v, 1);
+      } else {
+        input_images.emplace_back (image, 0, n_vols);
+      }
 
-    if (image.ndim () > 4)
-      throw Exception ("Input image \"" + image.name() + "\" contains more than 4 dimensions.");
+      if (i > 0)
+        check_dimensions (input_images[0].image, image, 0, 3);
 
-    // Elevate image dimensions to ensure it is 4-dimensional
-    // e.g. x,y,z -> x,y,z,1
-    // This ensures consistency across multiple tissue input images
-    Header h_image4d (image);
-    h_image4d.ndim() = 4;
-    input_images.emplace_back (image, h_image4d);
+      if (inplace) {
+        if (!image.datatype().is_floating_point())
+          throw Exception ("Cannot normalise image \"" + image.name() + "\" in place: image is not stored using a floating-point data type.");
+        output_filenames.push_back (argument[i]);
+        continue;
+      }
 
-    if (i > 0)
-      check_dimensions (input_images[0], input_images[i / 2], 0, 3);
+      // Output images are 4-dimensional (e.g. x,y,z -> x,y,z,1), for consistency across tissue types
+      Header h_image4d (image);
+      h_image4d.ndim() = 4;
 
-    if (Path::exists (argument[i + 1]) && !App::overwrite_files)
-      throw Exception ("Output file \"" + argument[i] + "\" already exists. (use -force option to force overwrite)");
+      if (Path::exists (argument[i + 1]) && !App::overwrite_files)
+        throw Exception ("Output file \"" + argument[i] + "\" already exists. (use -force option to force overwrite)");
 
-    output_headers.push_back (std::move (h_image4d));
-    output_filenames.push_back (argument[i + 1]);
+      output_headers.push_back (std::move (h_image4d));
+      output_filenames.push_back (argument[i + 1]);
+    }
   }
 
-  // Preparing default settings to the output images
-  output_image = DefineOutput(output_filenames, output_headers);
-
   // Setting the n_tissue_types
   const size_t n_tissue_types = input_images.size();
 
+  // Set up the exchange of partial results if the fit is distributed over several processes
+  Shard shard;
+  auto opt = get_options ("shard");
+  if (opt.size()) {
+    auto dir_opt = get_options ("shard_dir");
+    if (!dir_opt.size())
+      throw Exception ("The -shard option requires the -shard_dir option.");
+    shard = Shard (dir_opt[0][0], opt[0][0], opt[0][1]);
+  }
+
   // Load the mask and refine the initial mask to exclude non-positive summed tissue components
-  Header header_3D (input_images[0]);
+  Header header_3D (input_images[0].image);
   header_3D.ndim() = 3;
   header_3D.datatype() = DataType::Float32;
-  auto opt = get_options ("mask");
-
-  auto orig_mask = MaskType::open (opt[0][0]);
+  // (each shard must cover at least one slice)
+  if (shard.count() > size_t (header_3D.size(2)))
+    throw Exception ("The number of shards (" + str(shard.count()) + ") exceeds the number of slices of the input images (" + str(header_3D.size(2)) + ").");
+  const auto z_range = shard.range (header_3D.size(2));
+  opt = get_options ("mask");
+
+  auto orig_mask = open_image<bool> (opt[0][0]);
+  check_dimensions (orig_mask, header_3D, 0, 3);
   Header mask_header (orig_mask);
   mask_header.ndim() = 3;
   mask_header.datatype() = DataType::Bit;
   Stride::set (mask_header, header_3D);
 
-  auto initial_mask = MaskType::scratch (mask_header, "Initial processing mask");
-  auto mask = MaskType::scratch (mask_header, "Processing mask");
-  auto prev_mask = MaskType::scratch (mask_header, "Previous processing mask");
+  // Define the regions for which separate normalisation fields are fitted: those of the label
+  // image (if any), and/or groups of slices
+  FieldRegions regions;
+  opt = get_options ("labels");
+  if (opt.size()) {
+    auto labels = open_image<uint32_t> (opt[0][0]);
+    check_dimensions (labels, header_3D, 0, 3);
+    // The regions are indexed densely, in increasing order of label value, so that sparse label
+    // values (e.g. FreeSurfer's) do not give rise to empty regions
+    std::map<uint32_t, size_t> region_voxels;
+    for (auto i = Loop (0, 3) (labels, orig_mask); i; ++i) {
+      size_t& voxels (region_voxels[labels.value()]);
+      if (orig_mask.value())
+        ++voxels;
+    }
+    std::map<uint32_t, uint32_t> region_index;
+    for (const auto& region : region_voxels) {
+      if (!region.second)
+        WARN ("region " + str(region.first) + " of the label image contains no voxels within the mask; it will not be normalised");
+      const uint32_t index = region_index.size();
+      region_index[region.first] = index;
+    }
+    Header index_header (header_3D);
+    index_header.datatype() = DataType::UInt32;
+    auto indices = scratch_image<uint32_t> (index_header, "Label region indices");
+    for (auto i = Loop (0, 3) (labels, indices); i; ++i)
+      indices.value() = region_index.find (labels.value())->second;
+    regions.labels = indices;
+    regions.n_labels = std::max<size_t> (region_index.size(), 1);
+  }
+  opt = get_options ("slicewise");
+  if (opt.size()) {
+    regions.slices_per_group = opt[0][0].as_int();
+    regions.n_groups = (header_3D.size(2) + regions.slices_per_group - 1) / regions.slices_per_group;
+  }
+  if (regions.size() > 1)
+    INFO ("fitting separate normalisation fields for " + str(regions.size()) + " regions");
+
+  // Choose the execution strategy within the memory limit, before any tissue components are loaded
+  size_t initial_num_voxels = 0;
+  for (auto i = Loop (0, 3) (orig_mask); i; ++i)
+    if (orig_mask.value() && orig_mask.index(2) >= z_range.first && orig_mask.index(2) < z_range.second)
+      ++initial_num_voxels;
+  const FitPlan plan = PlanFit (input_images, output_headers, output_filenames, header_3D, z_range.second - z_range.first, initial_num_voxels,
+                                regions, basis_function, get_option_value ("niter", DEFAULT_MAIN_ITER_VALUE), shard.active(),
+                                size_t (get_option_value<int64_t> ("memory_limit", 0)) << 20, get_options ("precision").size() ? get_option_value<int> ("precision", 0) : -1);
+  if (get_options ("dry_run").size()) {
+    plan.estimate.print();
+    return;
+  }
+  INFO ("execution strategy: " + plan.estimate.strategy + "; estimated peak memory " + str(plan.estimate.peak_bytes() >> 20) + " MB");
 
-{
-  auto summed = ImageType::scratch (header_3D, "Summed tissue volumes");
-  RefinedMask(input_images, initial_mask, orig_mask, input_progress, summed);
-}
+  // Preparing default settings to the output images
+  if (!inplace)
+    output_image = DefineOutput(output_filenames, output_headers);
 
-  threaded_copy (initial_mask, mask);
+  auto initial_mask = scratch_image<bool> (mask_header, "Initial processing mask");
+  auto mask = scratch_image<bool> (mask_header, "Processing mask");
+  auto prev_mask = scratch_image<bool> (mask_header, "Previous processing mask");
 
-  // Load input images into single 4d-image and zero-clamp combined-tissue image
-  Header h_combined_tissue (input_images[0]);
-  h_combined_tissue.ndim () = 4;
-  h_combined_tissue.size (3) = n_tissue_types;
-  auto combined_tissue = ImageType::scratch (h_combined_tissue, "Tissue components");
+  // Look up the result of an identical previous fit in the cache, if requested
+  std::string cache_entry;
+  bool cached = false;
+  opt = get_options ("cache");
+  if (opt.size()) {
+    if (shard.active())
+      throw Exception ("The -cache option cannot be used with the -shard option.");
+    std::string settings = "order=" + str(order) + ";slicewise=" + str(get_option_value<int> ("slicewise", 0)) +
+                           ";niter=" + str(get_option_value ("niter", DEFAULT_MAIN_ITER_VALUE)) + ";value=" + str(get_option_value ("value", DEFAULT_NORM_VALUE), 17) +
+                           ";tolerance=" + str(get_option_value ("tolerance", 0.0), 17) + ";memory_limit=" + str(get_option_value<int64_t> ("memory_limit", 0)) +
+                           ";precision=" + str(int (plan.precision));
+    for (const char* file_option : { "init", "init_transform" }) {
+      auto file_opt = get_options (file_option);
+      if (file_opt.size()) {
+        std::ifstream in (file_opt[0][0]);
+        settings += ";" + std::string (file_option) + "=" + std::string (std::istreambuf_iterator<char> (in), std::istreambuf_iterator<char>());
+      }
+    }
+    for (const auto& view : input_images)
+      ParallelGZ::wait (view.image.name());
+    cache_entry = Path::join (opt[0][0], CacheKey (input_images, orig_mask, regions, settings));
+    cached = Path::exists (cache_entry + ".fit") && Path::exists (cache_entry + "-mask.mif");
+    if (cached) {
+      INFO ("using cached fit \"" + cache_entry + ".fit\"");
+      auto cached_mask = MaskType::open (cache_entry + "-mask.mif");
+      check_dimensions (cached_mask, mask);
+      tiled_copy (cached_mask, mask);
+    }
+  }
 
-  for (size_t i = 0; i < n_tissue_types; ++i) {
-    input_progress++;
-    combined_tissue.index (3) = i;
-    ThreadedLoop (combined_tissue, 0, 3).run ([](decltype(combined_tissue)& comb, decltype(input_images[0]) in) { comb.value() = std::max<float>(in.value (), 0.f); },combined_tissue, input_images[i]);
+  if (!cached) {
+    RefinedMask(input_images, initial_mask, orig_mask, z_range, input_progress);
+    tiled_copy (initial_mask, mask);
   }
+  // (compressed input images are decompressed in the background, and only overlap with the first pass over the data)
+  for (const auto& view : input_images)
+    ParallelGZ::wait (view.image.name());
 
   size_t num_voxels = 0;
-  ThreadedLoop (mask, 0, 3).run ([&num_voxels](decltype(mask) mask) { if (mask.value()) ++num_voxels; }, mask);
+  for (auto i = Loop (0, 3) (mask); i; ++i)
+    if (mask.value())
+      ++num_voxels;
+  const size_t local_num_voxels = num_voxels;
+  num_voxels = SumOverShards (shard, num_voxels);
 
   if (!num_voxels)
     throw Exception ("Mask contains no valid voxels.");
 
+  // Load input images into a single 4d-image of zero-clamped tissue components, either
+  // for the whole image, or in slabs streamed from the input images if memory is limited
+  const Transform transform (mask);
+  const TissuePrecision precision = plan.precision;
+  TissueSlabs slabs (input_images, header_3D, transform, basis_function, regions, z_range, plan.slab_depth, precision);
+  // Pre-size the buffer for exact quartiles in outlier rejection (only used if not streaming)
+  if (slabs.in_memory() && !shard.active())
+    slabs.arena.reserve_values (local_num_voxels);
+  if (shard.active())
+    INFO ("shard " + str(shard.index()) + " of " + str(shard.count()) + ": processing slices " + str(z_range.first) + " to " + str(z_range.second - 1));
+  if (cached) {
+    INFO ("fit retrieved from cache; tissue components not loaded");
+  } else if (slabs.in_memory()) {
+    slabs.load_tissue (0, &input_progress);
+  } else {
+    INFO ("streaming tissue components from input images in " + str(slabs.num_slabs()) + " slabs of " + str(slabs.slab_depth()) + " slices");
+    for (size_t i = 0; i < argument.size(); i += arg_step) {
+      if (ParallelGZ::compressed (argument[i]) && (!ParallelGZ::enabled() || ParallelGZ::in_memory (argument[i], 0)))
+        WARN ("compressed input image \"" + std::string (argument[i]) + "\" will be held in memory in its entirety");
+    }
+  }
+
   const float normalisation_value = get_option_value ("value", DEFAULT_NORM_VALUE);
   const float log_norm_value = std::log (normalisation_value);
-  const size_t max_iter = get_option_value ("niter", DEFAULT_MAIN_ITER_VALUE);
+  const size_t max_iter = cached ? 0 : get_option_value ("niter", DEFAULT_MAIN_ITER_VALUE);
   const size_t max_balance_iter = DEFAULT_BALANCE_MAXITER_VALUE;
 
-  // Initialise normalisation fields in both image and log domain
-  Eigen::MatrixXd norm_field_weights;
-
-  auto norm_field_image = ImageType::scratch (header_3D, "Normalisation field (intensity)");
-  auto norm_field_log = ImageType::scratch (header_3D, "Normalisation field (log-domain)");
-  ThreadedLoop (norm_field_image).run ([](decltype(norm_field_image)& in) { in.value() = 1.0; },norm_field_image);
+  // Initialise normalisation field weights (zero in the log domain, i.e. a unit field)
+  // (with the weights of all regions stacked, region by region)
+  Eigen::VectorXd norm_field_weights (Eigen::VectorXd::Zero (regions.size() * basis_function.n_basis_vecs));
 
   Eigen::VectorXd balance_factors (Eigen::VectorXd::Ones (n_tissue_types));
+
+  // Alternatively, start from the weights and balance factors of a previous fit
+  opt = get_options ("init");
+  if (opt.size()) {
+    ImportFit (opt[0][0], order, basis_function, regions.size(), norm_field_weights, balance_factors);
+    auto transform_opt = get_options ("init_transform");
+    if (transform_opt.size()) {
+      if (basis_function.planar)
+        throw Exception ("The -init_transform option cannot be used with the -slicewise option.");
+      norm_field_weights = TransformWeights (norm_field_weights, basis_function, load_transform (transform_opt[0][0]), transform, header_3D);
+    }
+    INFO ("initialised from previous fit; balance factors: " + str(balance_factors.transpose()));
+  } else if (get_options ("init_transform").size()) {
+    throw Exception ("The -init_transform option requires the -init option.");
+  }
+
+  if (cached)
+    ImportFit (cache_entry + ".fit", order, basis_function, regions.size(), norm_field_weights, balance_factors);
+
+  const double tolerance = get_option_value ("tolerance", 0.0);
   size_t iter = 1;
   input_progress.done ();
   ProgressBar progress ("performing log-domain intensity normalisation", max_iter);
@@ -418,12 +1823,14 @@ void run ()
   size_t vox_count, new_vox_count;
 
   // Perform an initial outlier rejection prior to the first iteration
-  vox_count = OutlierRejection(3.f, mask, initial_mask, header_3D, combined_tissue, norm_field_image, balance_factors, num_voxels);
-  threaded_copy (mask, prev_mask);
+  // (unless the final mask was retrieved from the cache)
+  vox_count = cached ? num_voxels : OutlierRejection(3.f, mask, initial_mask, slabs, norm_field_weights, balance_factors, num_voxels, shard);
+  tiled_copy (mask, prev_mask);
 
   while (iter <= max_iter) {
 
     INFO ("Iteration: " + str(iter));
+    Trace::Span iteration_span ("iteration " + str(iter));
 
     // Iteratively compute tissue balance factors with outlier rejection
     size_t balance_iter = 1;
@@ -432,14 +1839,12 @@ void run ()
     while (!balance_converged && balance_iter <= max_balance_iter) {
 
       DEBUG ("Balance and outlier rejection iteration " + str(balance_iter) + " starts.");
+      Trace::Span balance_span ("balance iteration " + str(balance_iter));
 
       if (n_tissue_types > 1) {
 
         // Solve for tissue balance factors
-        Eigen::MatrixXd X (vox_count, n_tissue_types);
-        Eigen::VectorXd y (Eigen::VectorXd::Ones (vox_count));
-        BalFactSolver(X, y, mask, combined_tissue, norm_field_image, n_tissue_types);
-        balance_factors = Choleski(X, y);
+        balance_factors = BalFactSolver(slabs, mask, norm_field_weights, shard);
 
         // Ensure our balance factors satisfy the condition that sum(log(balance_factors)) = 0
         double log_sum = 0.0;
@@ -456,7 +1861,7 @@ void run ()
       INFO ("Balance factors (" + str(balance_iter) + "): " + str(balance_factors.transpose()));
 
       // Perform outlier rejection on log-domain of summed images
-      new_vox_count = OutlierRejection(1.5f, mask, initial_mask, header_3D, combined_tissue, norm_field_image, balance_factors, vox_count);
+      new_vox_count = OutlierRejection(1.5f, mask, initial_mask, slabs, norm_field_weights, balance_factors, vox_count, shard);
 
       // Check for convergence
       balance_converged = true;
@@ -464,48 +1869,87 @@ void run ()
          balance_converged = false;
          vox_count = new_vox_count;
       }else{
+         size_t mask_changed = 0;
          for (auto i = Loop (0, 3) (mask, prev_mask); i; ++i) {
             if (mask.value() != prev_mask.value()) {
-            balance_converged = false;
-            vox_count = new_vox_count;
+            mask_changed = 1;
             break;
             }
          }
+         if (SumOverShards (shard, mask_changed)) {
+            balance_converged = false;
+            vox_count = new_vox_count;
+         }
       }
-      threaded_copy (mask, prev_mask);
+      tiled_copy (mask, prev_mask);
       balance_iter++;
     }
 
     // Solve for normalisation field weights in the log domain
-    Transform transform (mask);
-    Eigen::MatrixXd norm_field_basis (vox_count, basis_function.n_basis_vecs);
-    Eigen::VectorXd y (vox_count);
-    NormWeightsLog(norm_field_basis, y, balance_factors, basis_function, mask, combined_tissue, transform, n_tissue_types, log_norm_value);
-    norm_field_weights = Choleski(norm_field_basis, y);
-
-    // Generate normalisation field in the log domain
-    ThreadedLoop (norm_field_log, 0, 3).run (NormFieldLog(norm_field_weights, transform, basis_function), norm_field_log);
-
-    // Generate normalisation field in the image domain
-    ThreadedLoop (norm_field_image).run([](decltype(norm_field_image)& out, decltype(norm_field_log) in){out.value() = std::exp (in.value());}, norm_field_image, norm_field_log);
+    // (the normalisation field itself is evaluated from these as each slab is next accessed)
+    double field_change;
+    norm_field_weights = NormWeightsLog(slabs, mask, regions, balance_factors, basis_function, transform, log_norm_value, shard, norm_field_weights, field_change);
+    INFO ("RMS change of log-domain normalisation field: " + str(field_change));
+    Timings::iteration ({ { "balance_iterations", double (balance_iter - 1) }, { "masked_voxels", double (vox_count) }, { "field_change", field_change } });
 
     progress++;
     iter++;
+
+    if (field_change < tolerance) {
+      INFO ("converged after " + str(iter-1) + " iterations");
+      break;
+    }
   }
   progress.done();
+  INFO ("peak scratch arena usage: " + str(slabs.arena.peak_bytes() >> 20) + " MB");
+  // The log-domain field is a least-squares fit to the log of the summed tissue components within
+  // the mask, each perturbed by at most the largest rounding error of its tissue values; for a given
+  // mask, the root-mean-square change of the fitted field is therefore bounded by that error
+  if (precision != TissuePrecision::Float32 && !cached)
+    INFO (std::string (precision_choices[int (precision)]) + " storage of tissue components: rounding error (absolute log-ratio) "
+          "RMS " + str(slabs.rms_rounding_error()) + ", max " + str(slabs.max_rounding_error()) +
+          "; RMS change of log-domain normalisation field bounded by " + str(slabs.max_rounding_error()) + " (for the final mask)");
+
+  // (this phase lasts until the end of the command)
+  Timings::Phase output_phase ("output");
+
+  // Compute log-norm scale parameter (geometric mean of normalisation field in outlier-free mask).
+  const double lognorm_scale = LogScale(slabs, mask, norm_field_weights, vox_count, shard);
+  const bool output_balanced = get_options("balanced").size();
+
+  // Only shard 0 writes the outputs, evaluating the normalisation field over the whole image
+  if (shard.active()) {
+    if (get_options ("check_mask").size())
+      GatherMask (shard, mask);
+    shard.finish();
+    if (shard.index())
+      return;
+    slabs.set_range ({ 0, header_3D.size(2) });
+  }
 
-  ProgressBar output_progress("writing output images", output_filenames.size());
+  ProgressBar output_progress("writing output images", n_tissue_types);
 
   opt = get_options ("check_norm");
   if (opt.size()) {
-    auto norm_field_output = ImageType::create (opt[0][0], header_3D);
-    threaded_copy (norm_field_image, norm_field_output);
+    ParallelGZ::Output file (opt[0][0]);
+    {
+      auto norm_field_output = file.create<ValueType> (header_3D);
+      for (size_t n = 0; n < slabs.num_slabs(); ++n) {
+        slabs.load_field (n, norm_field_weights);
+        TiledLoop (CopySlab (norm_field_output, slabs.offset (n)), slabs.norm_field_image);
+      }
+    }
+    file.commit();
   }
 
   opt = get_options ("check_mask");
   if (opt.size()) {
-    auto mask_output = ImageType::create (opt[0][0], mask);
-    threaded_copy (mask, mask_output);
+    ParallelGZ::Output file (opt[0][0]);
+    {
+      auto mask_output = file.create<ValueType> (mask);
+      tiled_copy (mask, mask_output);
+    }
+    file.commit();
   }
 
   opt = get_options ("check_factors");
@@ -514,32 +1958,111 @@ void run ()
     factors_output << balance_factors;
   }
 
-  // Compute log-norm scale parameter (geometric mean of normalisation field in outlier-free mask).
-  double lognorm_scale (0.0);
-  LogScale(lognorm_scale, vox_count, mask, norm_field_log);
-  const bool output_balanced = get_options("balanced").size();
+  opt = get_options ("export_fit");
+  if (opt.size())
+    ExportFit (opt[0][0], order, basis_function, regions.size(), norm_field_weights, balance_factors);
+
+  if (cache_entry.size() && !cached)
+    SaveCachedFit (cache_entry, mask, order, basis_function, regions.size(), norm_field_weights, balance_factors);
+
+  // lognorm_balance entry for the image holding tissue component j (all tissue components if -multitissue)
+  auto lognorm_balance = [&] (size_t j) -> std::string {
+    if (!multitissue)
+      return str(balance_factors[j]);
+    std::string entry = str(balance_factors[0]);
+    for (size_t k = 1; k < n_tissue_types; ++k)
+      entry += "," + str(balance_factors[k]);
+    return entry;
+  };
+
+  if (inplace) {
+    for (size_t j = 0; j < n_tissue_types; ++j) {
+      output_progress++;
+      const float balance_multiplier = output_balanced ? balance_factors[j] : 1.0f;
+
+      struct ScaleInPlace {
+        ScaleInPlace (const TissueView& in_out, float balance_multiplier, ssize_t slab_offset) :
+          in_out (in_out), balance_multiplier (balance_multiplier), slab_offset (slab_offset) { }
+        FORCE_INLINE void operator () (ImageType& norm_field_im) {
+          in_out.set_voxel (norm_field_im, slab_offset);
+          const bool negative = in_out.value() < 0.f;
+          for (ssize_t v = 0; v < in_out.n_vols; ++v) {
+            in_out.set_volume (v);
+            in_out.image.value() = negative ? 0.f : in_out.value() * balance_multiplier / norm_field_im.value();
+          }
+        }
+        TissueView in_out;
+        float balance_multiplier;
+        ssize_t slab_offset;
+      };
+      // Scale slab by slab, so that the normalisation field is only ever held for a single slab
+      for (size_t n = 0; n < slabs.num_slabs(); ++n) {
+        slabs.load_field (n, norm_field_weights);
+        TiledLoop (ScaleInPlace (input_images[j], balance_multiplier, slabs.offset (n)), slabs.norm_field_image);
+      }
+    }
 
-  for (size_t j = 0; j < output_filenames.size(); ++j) {
+    // Release the memory-mapped images, so that all modifications are committed
+    // to file before their headers are updated
+    input_images.clear();
+    slabs.release_inputs();
+
+    for (size_t j = 0; j < output_filenames.size(); ++j) {
+      KeyValues entries;
+      entries["lognorm_scale"] = str(lognorm_scale);
+      if (output_balanced)
+        entries["lognorm_balance"] = lognorm_balance (j);
+      UpdateMIFKeyvals (output_filenames[j], entries);
+    }
+    return;
+  }
+
+  // Compressed output images are written to temporary files, and compressed once complete
+  vector<ParallelGZ::Output> output_files;
+  for (const auto& filename : output_filenames)
+    output_files.emplace_back (filename);
+
+  for (size_t j = 0; j < n_tissue_types; ++j) {
     output_progress++;
 
     float balance_multiplier = 1.0f;
-    output_headers[j].keyval()["lognorm_scale"] = str(lognorm_scale);
-    if (output_balanced) {
+    if (output_balanced)
       balance_multiplier = balance_factors[j];
-      output_headers[j].keyval()["lognorm_balance"] = str(balance_multiplier);
-    }
 
-    output_image = ImageType::create (output_filenames[j], output_headers[j]);
-    const size_t n_vols = input_images[j].size(3);
-    const Eigen::VectorXf zero_vec = Eigen::VectorXf::Zero (n_vols);
+    // With -multitissue, all tissue components are written to the volumes of a single output image
+    const size_t o = multitissue ? 0 : j;
+    if (!multitissue || !j) {
+      output_headers[o].keyval()["lognorm_scale"] = str(lognorm_scale);
+      if (output_balanced)
+        output_headers[o].keyval()["lognorm_balance"] = lognorm_balance (j);
+      output_image = output_files[o].create<ValueType> (output_headers[o]);
+      if (MemoryPlan::held_in_memory (output_filenames[o]))
+        first_touch (output_image, "output image \"" + output_filenames[o] + "\"");
+      else
+        huge_pages (output_image, "output image \"" + output_filenames[o] + "\" (memory-mapped)");
+    }
+    const TissueView output_view (output_image, multitissue ? j : 0, input_images[j].n_vols);
 
      struct ReadInOutput {
-     ReadInOutput (Eigen::VectorXf zero_vec, float balance_multiplier) : zero_vec (zero_vec), balance_multiplier (balance_multiplier) { }
-     FORCE_INLINE void operator () (decltype(output_image)& out_im, decltype(input_images[0]) in_im, decltype(norm_field_image) norm_field_im)
-     {in_im.index(3) = 0; if (in_im.value() < 0.f) { out_im.row(3) = zero_vec; }else{ out_im.row(3) = Eigen::VectorXf{in_im.row(3)} * balance_multiplier / norm_field_im.value(); } }
-     Eigen::VectorXf zero_vec;
+     ReadInOutput (const TissueView& out_im, const TissueView& in_im, float balance_multiplier, ssize_t slab_offset) :
+       out_im (out_im), in_im (in_im), balance_multiplier (balance_multiplier), slab_offset (slab_offset) { }
+     FORCE_INLINE void operator () (ImageType& norm_field_im)
+     {AllocStats::HotRegion hot ("ReadInOutput");
+      out_im.set_voxel (norm_field_im, slab_offset); in_im.set_voxel (norm_field_im, slab_offset);
+      const bool negative = in_im.value() < 0.f;
+      for (ssize_t v = 0; v < in_im.n_vols; ++v) { in_im.set_volume (v); out_im.set_volume (v); out_im.image.value() = negative ? 0.f : in_im.value() * balance_multiplier / norm_field_im.value(); } }
+     TissueView out_im;
+     TissueView in_im;
      float balance_multiplier;
+     ssize_t slab_offset;
       };
-  ThreadedLoop (output_image, 0, 3).run (ReadInOutput(zero_vec, balance_multiplier), output_image, input_images[j], norm_field_image);
+  for (size_t n = 0; n < slabs.num_slabs(); ++n) {
+    slabs.load_field (n, norm_field_weights);
+    TiledLoop (ReadInOutput(output_view, input_images[j], balance_multiplier, slabs.offset (n)), slabs.norm_field_image);
+  }
  }
+  output_image = ImageType();
+  for (auto& file : output_files)
+    file.commit();
+  HugePages::report();
 }
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "command.h"
+#include "image.h"
+#include "algo/loop.h"
+#include "file/ofstream.h"
+#include "transform.h"
+
+#include <random>
+
+using namespace MR;
+using namespace App;
+
+#define DEFAULT_NORM_VALUE 0.28209479177
+#define DEFAULT_VOXEL_SIZE 2.0
+#define DEFAULT_FIELD_ORDER 3
+#define DEFAULT_FIELD_STRENGTH 0.3
+#define DEFAULT_OUTLIERS 0.01
+#define DEFAULT_NOISE 0.02
+
+// Field of view (in mm), and semi-axes of the ellipsoidal brain, along x, y and z
+const double fov[3] = { 160.0, 192.0, 144.0 };
+const double semi_axes[3] = { 70.0, 85.0, 60.0 };
+
+const char* field_choices[] = { "polynomial", "smooth", nullptr };
+
+void usage ()
+{
+  AUTHOR = "Thijs Dhollander (thijs.dhollander@gmail.com), Rami Tabbara (rami.tabbara@florey.edu.au) and David Raffelt (david.raffelt@florey.edu.au)";
+
+  SYNOPSIS = "Generate a synthetic multi-tissue phantom with known bias field and balance factors for the mtnormalise command";
+
+  DESCRIPTION
+    + "The phantom is an ellipsoidal brain of white matter, surrounded by a shell of grey matter and "
+      "one of CSF, with CSF-filled ventricles, over a fixed field of view of 160 x 192 x 144 mm; the tissue "
+      "fractions sum to one in every voxel within the brain, with partial volume at the tissue boundaries."
+
+    + "Each tissue component is that fraction, multiplied by the bias field and by the reference value of "
+      "mtnormalise (" + str(DEFAULT_NORM_VALUE, 6) + "), and divided by the balance factor of its tissue: "
+      "mtnormalise should therefore recover the bias field and the balance factors (normalised to a unit "
+      "geometric mean, as in mtnormalise) from all but the outlier voxels. The bias field is either a "
+      "random polynomial (in the log domain) of the order set by the -field_order option, which the fit "
+      "can represent exactly at that order or above, or a smooth field built from a few Gaussian bumps "
+      "(in the log domain), which it can only approximate."
+
+    + "A fraction of the voxels within the brain are made outliers, by scaling all their tissue "
+      "components by a random factor between 3 and 10, or between 0.1 and 0.3. Multiplicative Gaussian "
+      "noise is added to all tissue components."
+
+    + "The phantom is fully determined by the options, including the seed of the random number "
+      "generator, so that benchmarks can be repeated on identical data. "
+      "Example usage: mtnormphantom tissues.mif mask.mif field.mif factors.txt -voxel_size 1; "
+      "mtnormalise tissues.mif normalised.mif -multitissue -mask mask.mif -check_norm fitted_field.mif -check_factors fitted_factors.txt.";
+
+  ARGUMENTS
+    + Argument ("tissues", "the output tissue components (4D image, with one volume per tissue: white matter, grey matter and CSF).").type_image_out ()
+    + Argument ("mask", "the output brain mask.").type_image_out ()
+    + Argument ("field", "the output ground truth bias field.").type_image_out ()
+    + Argument ("factors", "the output ground truth balance factors.").type_file_out ();
+
+  OPTIONS
+    + Option ("voxel_size", "the (isotropic) voxel size in mm (default: " + str(DEFAULT_VOXEL_SIZE) + ")")
+    +   Argument ("mm").type_float (0.1)
+
+    + Option ("field", "the type of bias field: polynomial or smooth (default: polynomial)")
+    +   Argument ("type").type_choice (field_choices)
+
+    + Option ("field_order", "the order of the polynomial bias field (default: " + str(DEFAULT_FIELD_ORDER) + ")")
+    +   Argument ("order").type_integer (0, 3)
+
+    + Option ("field_strength", "the largest absolute value of the log of the bias field within the brain (default: " + str(DEFAULT_FIELD_STRENGTH) + ")")
+    +   Argument ("value").type_float (0.0)
+
+    + Option ("factors", "the balance factors of white matter, grey matter and CSF, normalised to a unit geometric mean (default: 1.2,0.9,0.95)")
+    +   Argument ("values").type_sequence_float()
+
+    + Option ("outliers", "the fraction of voxels within the brain that are outliers (default: " + str(DEFAULT_OUTLIERS) + ")")
+    +   Argument ("value").type_float (0.0, 1.0)
+
+    + Option ("noise", "the standard deviation of the multiplicative Gaussian noise (default: " + str(DEFAULT_NOISE) + ")")
+    +   Argument ("value").type_float (0.0)
+
+    + Option ("seed", "the seed of the random number generator (default: 0)")
+    +   Argument ("value").type_integer (0);
+}
+
+
+
+// Smooth step from 0 (for x well below edge) to 1 (for x well above edge), over the given width
+inline double step (double x, double edge, double width)
+{
+  return 1.0 / (1.0 + std::exp (-(x - edge) / width));
+}
+
+
+
+void run ()
+{
+  const double voxel_size = get_option_value ("voxel_size", DEFAULT_VOXEL_SIZE);
+  const bool polynomial = get_option_value ("field", 0) == 0;
+  const int field_order = get_option_value ("field_order", DEFAULT_FIELD_ORDER);
+  const double field_strength = get_option_value ("field_strength", DEFAULT_FIELD_STRENGTH);
+  const double outliers = get_option_value ("outliers", DEFAULT_OUTLIERS);
+  const double noise = get_option_value ("noise", DEFAULT_NOISE);
+
+  Eigen::Vector3d balance_factors (1.2, 0.9, 0.95);
+  auto opt = get_options ("factors");
+  if (opt.size()) {
+    const auto values = opt[0][0].as_sequence_float();
+    if (values.size() != 3)
+      throw Exception ("the -factors option expects three values");
+    for (size_t t = 0; t < 3; ++t) {
+      if (values[t] <= 0.0)
+        throw Exception ("balance factors must be positive");
+      balance_factors[t] = values[t];
+    }
+  }
+  balance_factors /= std::exp (balance_factors.array().log().mean());
+  File::OFStream factors_output (argument[3]);
+  factors_output << balance_factors;
+
+  std::mt19937 rng (get_option_value ("seed", 0));
+  std::uniform_real_distribution<double> uniform (0.0, 1.0);
+  std::normal_distribution<double> gaussian (0.0, noise);
+
+  Header header;
+  header.ndim() = 3;
+  for (size_t n = 0; n < 3; ++n) {
+    header.size(n) = std::max (1, int (std::round (fov[n] / voxel_size)));
+    header.spacing(n) = voxel_size;
+  }
+  header.transform().setIdentity();
+  header.transform().translation() = Eigen::Vector3d (-0.5 * (header.size(0) - 1) * voxel_size, -0.5 * (header.size(1) - 1) * voxel_size,
+                                                       -0.5 * (header.size(2) - 1) * voxel_size);
+  header.datatype() = DataType::Float32;
+
+  auto field = Image<float>::create (argument[2], header);
+  header.datatype() = DataType::Bit;
+  auto mask = Image<bool>::create (argument[1], header);
+  header.ndim() = 4;
+  header.size(3) = 3;
+  header.spacing(3) = 1.0;
+  header.datatype() = DataType::Float32;
+  Stride::set (header, Stride::contiguous_along_axis (3, header));
+  auto tissues = Image<float>::create (argument[0], header);
+  const Transform transform (field);
+
+  // Log-domain bias field: a polynomial of the position (relative to the semi-axes of the brain),
+  // or a sum of Gaussian bumps centred within the brain, with random weights
+  vector<Eigen::Vector3i> powers;
+  for (int i = 0; i <= field_order; ++i)
+    for (int j = 0; i + j <= field_order; ++j)
+      for (int k = 0; i + j + k <= field_order; ++k)
+        powers.push_back (Eigen::Vector3i (i, j, k));
+  const size_t num_bumps = 4;
+  vector<Eigen::Vector3d> centres;
+  vector<double> widths;
+  Eigen::VectorXd weights (polynomial ? powers.size() : num_bumps);
+  for (ssize_t n = 0; n < weights.size(); ++n)
+    weights[n] = 2.0 * uniform (rng) - 1.0;
+  if (!polynomial) {
+    for (size_t n = 0; n < num_bumps; ++n) {
+      centres.push_back (Eigen::Vector3d ((uniform (rng) - 0.5) * semi_axes[0], (uniform (rng) - 0.5) * semi_axes[1], (uniform (rng) - 0.5) * semi_axes[2]));
+      widths.push_back (30.0 + 30.0 * uniform (rng));
+    }
+  }
+  auto log_field = [&] (const Eigen::Vector3d& pos) {
+    double value = 0.0;
+    if (polynomial) {
+      const Eigen::Vector3d u (pos[0] / semi_axes[0], pos[1] / semi_axes[1], pos[2] / semi_axes[2]);
+      for (size_t n = 0; n < powers.size(); ++n)
+        value += weights[n] * std::pow (u[0], powers[n][0]) * std::pow (u[1], powers[n][1]) * std::pow (u[2], powers[n][2]);
+    }
+    else {
+      for (size_t n = 0; n < num_bumps; ++n)
+        value += weights[n] * std::exp (-0.5 * (pos - centres[n]).squaredNorm() / (widths[n] * widths[n]));
+    }
+    return value;
+  };
+
+  // First pass: brain mask, and unscaled log-domain field
+  double max_log_field = 0.0;
+  for (auto l = Loop ("generating bias field", 0, 3) (field, mask); l; ++l) {
+    const Eigen::Vector3d pos = transform.voxel2scanner * Eigen::Vector3d (field.index(0), field.index(1), field.index(2));
+    const double r = Eigen::Vector3d (pos[0] / semi_axes[0], pos[1] / semi_axes[1], pos[2] / semi_axes[2]).norm();
+    mask.value() = r <= 1.0;
+    field.value() = log_field (pos);
+    if (mask.value())
+      max_log_field = std::max (max_log_field, std::abs (double (field.value())));
+  }
+  const double scale = max_log_field > 0.0 ? field_strength / max_log_field : 0.0;
+
+  // Second pass: scaled field, and tissue components from the tissue fractions at the normalised radius
+  size_t num_outliers = 0;
+  const double edge_width = 0.5 * voxel_size;
+  for (auto l = Loop ("generating tissue components", 0, 3) (field, mask, tissues); l; ++l) {
+    field.value() = std::exp (scale * field.value());
+    Eigen::Vector3d fractions (0.0, 0.0, 0.0);
+    if (mask.value()) {
+      const Eigen::Vector3d pos = transform.voxel2scanner * Eigen::Vector3d (field.index(0), field.index(1), field.index(2));
+      const double r = Eigen::Vector3d (pos[0] / semi_axes[0], pos[1] / semi_axes[1], pos[2] / semi_axes[2]).norm();
+      const double d = r * semi_axes[1];
+      // CSF beyond 0.9 of the radius and in the ventricles, grey matter from 0.75 of the radius
+      const double csf = std::max (step (d, 0.9 * semi_axes[1], edge_width), 1.0 - step (d, 0.2 * semi_axes[1], edge_width));
+      const double gm = (1.0 - csf) * step (d, 0.75 * semi_axes[1], edge_width);
+      fractions = Eigen::Vector3d (1.0 - csf - gm, gm, csf);
+      double multiplier = field.value() * DEFAULT_NORM_VALUE;
+      if (uniform (rng) < outliers) {
+        multiplier *= uniform (rng) < 0.5 ? 3.0 + 7.0 * uniform (rng) : 0.1 + 0.2 * uniform (rng);
+        ++num_outliers;
+      }
+      for (size_t t = 0; t < 3; ++t)
+        fractions[t] *= multiplier * (1.0 + gaussian (rng)) / balance_factors[t];
+    }
+    for (auto t = Loop (3) (tissues); t; ++t)
+      tissues.value() = fractions[tissues.index(3)];
+  }
+
+  INFO ("phantom of " + str(header.size(0)) + "x" + str(header.size(1)) + "x" + str(header.size(2)) + " voxels, with " +
+        str(num_outliers) + " outlier voxels; balance factors: " + str(balance_factors.transpose()));
+}
@@ -23,15 +23,9 @@ function get_mask {
 # normalise_and_rescale weights
 # output.mif mask.mif rescaled_output.mif
 function normalise_and_rescale {
-  mrconvert "$1" __tmp-[].mif -force
-  #scale=($(~/mrtrix3_mine/bin/mtnormalise __tmp{,_norm}-0.mif __tmp{,_norm}-1.mif __tmp{,_norm}-2.mif -mask "$2" -info -force 2>&1 | grep "Balance factors" | tail -n 1 | awk '{ print $6, $7, $8 }'))
-  #scale=($(~/mrtrix3_extras/bin/mtnormalise __tmp{,_norm}-0.mif __tmp{,_norm}-1.mif __tmp{,_norm}-2.mif -mask "$2" -info -force 2>&1 | grep "Balance factors" | tail -n 1 | awk '{ print $6, $7, $8 }'))
-  scale=($(~/mrtrix3_extras/bin/mtnormalise __tmp{,_norm}-0.mif __tmp{,_norm}-1.mif __tmp{,_norm}-2.mif -mask "$2" -info -balanced  -force 2>&1 | grep "Balance factors" | tail -n 1 | awk '{ print $6, $7, $8 }'))
-  #scale=($(~/mrtrix3/bin/mtnormalise __tmp{,_norm}-0.mif __tmp{,_norm}-1.mif __tmp{,_norm}-2.mif -mask "$2" -info -force 2>&1 | grep "Balance factors" | tail -n 1 | awk '{ print $6, $7, $8 }'))
+  # (-balanced applies the balance factors to the output)
+  scale=($(~/mrtrix3_extras/bin/mtnormalise "$1" "$3" -multitissue -mask "$2" -info -balanced -force 2>&1 | grep "Balance factors" | tail -n 1 | awk '{ print $6, $7, $8 }'))
   echo ${scale[@]}
-  for n in {0..2}; do mrcalc __tmp_norm-$n.mif ${scale[$n]} -mult __tmp_norm_rescaled-$n.mif -force; done
-  mrcat __tmp_norm_rescaled-*.mif -axis 3 "$3"
-  rm -f __tmp*
 }
 
 # comparing H.txt and NewH.txt
@@ -145,3 +139,138 @@ get_mask output.mif mask.mif
 normalise_and_rescale output.mif mask.mif "$2"
 #rm mask.mif output.mif
 }
+
+# extract a numerical value from a -timings_file report, from the first line matching a pattern
+# timings.json pattern key
+function timings_value {
+  grep -- "$2" "$1" | head -n 1 | grep -o "\"$3\": [^,}]*" | sed 's/.*: //'
+}
+
+# benchmark icls on a synthetic phantom across thread counts and solver options, printing a
+# tab-separated table (one row per run) of the fit throughput, solver iterations and error
+# against the ground truth
+# size volumes parameters noise [threads ...]
+# e.g. icls_benchmark 64 30 3 0.01 1 2 4 8 > icls_benchmark.tsv
+function icls_benchmark {
+  local size=${1:-32} volumes=${2:-10} parameters=${3:-3} noise=${4:-0.01}
+  local threads=("${@:5}")
+  [ ${#threads[@]} -eq 0 ] && threads=(1 $(nproc))
+  local options=("" "-tolerance 1e-6" "-solution_norm 0.001")
+  local dir=$(mktemp -d)
+
+  ~/mrtrix3_extras/bin/iclsphantom "$dir/signal.mif" "$dir/H.txt" "$dir/truth.mif" -size $size,$size,$size \
+    -volumes $volumes -parameters $parameters -noise $noise -quiet
+
+  printf "size\tvolumes\tparameters\tnoise\tthreads\toptions\tvoxels\tfit_s\tvoxels_per_s\titerations_per_voxel\tnot_converged\trms_error\tmax_error\n"
+  for t in "${threads[@]}"; do
+    for o in "${options[@]}"; do
+      ~/mrtrix3_extras/bin/icls "$dir/signal.mif" "$dir/H.txt" "$dir/x.mif" $o -nthreads $t \
+        -timings_file "$dir/timings.json" -force -quiet
+      local fit=$(timings_value "$dir/timings.json" '"name": "fit"' wall)
+      local voxels=$(timings_value "$dir/timings.json" '"voxels"' voxels)
+      local iterations=$(timings_value "$dir/timings.json" '"voxels"' iterations_per_voxel)
+      local failed=$(timings_value "$dir/timings.json" '"voxels"' not_converged)
+      local mse=$(mrcalc "$dir/x.mif" "$dir/truth.mif" -subtract 2 -pow - -quiet | mrstats - -allvolumes -output mean)
+      local max=$(mrcalc "$dir/x.mif" "$dir/truth.mif" -subtract -abs - -quiet | mrstats - -allvolumes -output max)
+      printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" $size $volumes $parameters $noise $t "${o:-default}" \
+        $voxels $fit $(awk "BEGIN { print $voxels / $fit }") $iterations $failed $(awk "BEGIN { print sqrt($mse) }") $max
+    done
+  done
+
+  rm -rf "$dir"
+}
+
+# benchmark mtnormalise on synthetic phantoms with a known bias field and balance factors, across
+# voxel sizes, polynomial orders and thread counts, printing a tab-separated table (one row per run)
+# of the time per phase, peak memory, iterations to convergence and field recovery error. Each run
+# stops once the RMS change of the field falls below the tolerance (or after max_iterations): the
+# iteration at which it does so is reported as converged_iteration (NA if it never does)
+# "voxel_sizes" "orders" "threads" [field_type] [tolerance] [max_iterations]
+# e.g. mtnormalise_benchmark "2 1 0.5" "1 2 3" "1 4 8" smooth 1e-4 50 > mtnormalise_benchmark.tsv
+function mtnormalise_benchmark {
+  local sizes=(${1:-2 1 0.5}) orders=(${2:-3}) threads=(${3:-1 $(nproc)}) field=${4:-polynomial}
+  local tolerance=${5:-1e-4} max_iterations=${6:-50}
+  local phases=("loading" "RefinedMask" "OutlierRejection" "balance solve" "field solve" "field evaluation" "output")
+  local dir=$(mktemp -d)
+
+  printf "voxel_size\tfield\torder\tthreads\ttotal_s"
+  for p in "${phases[@]}"; do printf "\t%s_s" "${p// /_}"; done
+  printf "\tpeak_rss_mb\titerations\tconverged_iteration\tfield_rms_log_error\tbalance_max_rel_error\n"
+
+  for s in "${sizes[@]}"; do
+    ~/mrtrix3_extras/bin/mtnormphantom "$dir/tissues.mif" "$dir/mask.mif" "$dir/field.mif" "$dir/factors.txt" \
+      -voxel_size $s -field $field -quiet
+    for k in 0 1 2; do
+      mrconvert "$dir/tissues.mif" -coord 3 $k -axes 0,1,2 "$dir/tissue$k.mif" -force -quiet
+    done
+    for o in "${orders[@]}"; do
+      for t in "${threads[@]}"; do
+        ~/mrtrix3_extras/bin/mtnormalise "$dir/tissue0.mif" "$dir/out0.mif" "$dir/tissue1.mif" "$dir/out1.mif" \
+          "$dir/tissue2.mif" "$dir/out2.mif" -mask "$dir/mask.mif" -order $o -nthreads $t \
+          -niter $max_iterations -tolerance $tolerance -check_norm "$dir/fitted_field.mif" -check_factors "$dir/fitted_factors.txt" \
+          -timings_file "$dir/timings.json" -force -quiet
+        printf "%s\t%s\t%s\t%s\t%s" $s $field $o $t $(timings_value "$dir/timings.json" '"total"' wall)
+        for p in "${phases[@]}"; do
+          local wall=$(timings_value "$dir/timings.json" "\"name\": \"$p\"" wall)
+          printf "\t%s" ${wall:-0}
+        done
+        local rss=$(timings_value "$dir/timings.json" '"total"' peak_rss)
+        # (one record per iteration performed, each with the RMS change of the field)
+        local changes=($(grep -o '"field_change": [^ ,}]*' "$dir/timings.json" | sed 's/.*: //'))
+        local converged=$(printf "%s\n" "${changes[@]}" | awk -v tol=$tolerance '$1 < tol { print NR; exit }')
+        local mse=$(mrcalc "$dir/fitted_field.mif" "$dir/field.mif" -divide -log 2 -pow - -quiet | mrstats - -mask "$dir/mask.mif" -output mean)
+        local balance=$(paste "$dir/factors.txt" "$dir/fitted_factors.txt" | awk '{ e = ($2 - $1) / $1; if (e < 0) e = -e; if (e > m) m = e } END { print m }')
+        printf "\t%s\t%s\t%s\t%s\t%s\n" $(awk "BEGIN { print $rss / 1048576 }") ${#changes[@]} ${converged:-NA} $(awk "BEGIN { print sqrt($mse) }") $balance
+      done
+    done
+  done
+
+  rm -rf "$dir"
+}
+
+# check that the per-voxel kernels of icls and mtnormalise (their AllocStats hot regions) make no heap
+# allocations, on small synthetic phantoms: this requires commands built with -DMRTRIX_ALLOC_STATS,
+# and returns a non-zero status (listing the offending regions) if any allocation is recorded
+# e.g. check_hot_allocations && echo "no allocations in hot regions"
+function check_hot_allocations {
+  local dir=$(mktemp -d) status=0
+
+  ~/mrtrix3_extras/bin/iclsphantom "$dir/signal.mif" "$dir/H.txt" "$dir/truth.mif" -size 16,16,16 -volumes 10 -parameters 3 -quiet ||
+    { echo "iclsphantom failed" >&2; status=1; }
+  ~/mrtrix3_extras/bin/icls "$dir/signal.mif" "$dir/H.txt" "$dir/x.mif" -prediction "$dir/prediction.mif" \
+    -timings_file "$dir/icls.json" -force -quiet ||
+    { echo "icls failed" >&2; status=1; }
+
+  ~/mrtrix3_extras/bin/mtnormphantom "$dir/tissues.mif" "$dir/mask.mif" "$dir/field.mif" "$dir/factors.txt" -voxel_size 4 -quiet ||
+    { echo "mtnormphantom failed" >&2; status=1; }
+  ~/mrtrix3_extras/bin/mtnormalise "$dir/tissues.mif" "$dir/out.mif" -multitissue -mask "$dir/mask.mif" -order 3 -balanced \
+    -timings_file "$dir/mtnormalise.json" -force -quiet ||
+    { echo "mtnormalise failed" >&2; status=1; }
+  ~/mrtrix3_extras/bin/mtnormalise "$dir/tissues.mif" "$dir/out.mif" -multitissue -mask "$dir/mask.mif" -order 3 -slicewise 1 \
+    -timings_file "$dir/mtnormalise_slicewise.json" -force -quiet ||
+    { echo "mtnormalise -slicewise failed" >&2; status=1; }
+
+  # (each report is expected, so that a run which wrote none is reported rather than skipped)
+  for name in icls mtnormalise mtnormalise_slicewise; do
+    local f="$dir/$name.json"
+    if [ ! -f "$f" ]; then
+      echo "$name: no timings report written" >&2
+      status=1
+      continue
+    fi
+    if ! grep -q '"hot_regions"' "$f"; then
+      echo "$name: no allocation counts recorded (commands not built with -DMRTRIX_ALLOC_STATS)" >&2
+      status=1
+      continue
+    fi
+    while read -r region count; do
+      if [ "$count" != "0" ]; then
+        echo "$name: $count allocations in hot region $region" >&2
+        status=1
+      fi
+    done < <(grep -o '"name": "[^"]*", "allocations": [0-9]*' "$f" | sed 's/"name": "\([^"]*\)", "allocations": /\1 /')
+  done
+
+  rm -rf "$dir"
+  return $status
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "alloc_stats.h"
+
+#if defined(MRTRIX_ALLOC_STATS) && !defined(__GLIBC__)
+# warning "allocation statistics require the GNU C library, and will not be recorded"
+# undef MRTRIX_ALLOC_STATS
+#endif
+
+#ifdef MRTRIX_ALLOC_STATS
+# include <atomic>
+# include <cerrno>
+#endif
+
+namespace MR
+{
+
+#ifdef MRTRIX_ALLOC_STATS
+
+  namespace
+  {
+
+    // the counts of the calling thread: these are plain data, so that they can be
+    // accessed from within the allocation functions without themselves allocating
+    struct ThreadCounts {
+      uint64_t count, bytes;
+      const char* region;
+    };
+    thread_local ThreadCounts thread_counts = { 0, 0, nullptr };
+
+    struct HotRegionSlot {
+      std::atomic<const char*> name;
+      std::atomic<uint64_t> count, bytes;
+    };
+    HotRegionSlot hot_region_slots[ALLOC_STATS_MAX_HOT_REGIONS];
+
+    void record_hot (const char* region, size_t size)
+    {
+      // find the slot of the region, or claim the first free one
+      for (size_t n = 0; n < ALLOC_STATS_MAX_HOT_REGIONS; ++n) {
+        const char* name = hot_region_slots[n].name.load();
+        if (!name && hot_region_slots[n].name.compare_exchange_strong (name, region))
+          name = region;
+        if (name == region) {
+          ++hot_region_slots[n].count;
+          hot_region_slots[n].bytes += size;
+          return;
+        }
+      }
+    }
+
+    inline void record (size_t size)
+    {
+      ++thread_counts.count;
+      thread_counts.bytes += size;
+      if (thread_counts.region)
+        record_hot (thread_counts.region, size);
+    }
+
+  }
+
+  AllocStats::HotRegion::HotRegion (const char* name) :
+    previous (thread_counts.region)
+  {
+    thread_counts.region = name;
+  }
+
+  AllocStats::HotRegion::~HotRegion ()
+  {
+    thread_counts.region = previous;
+  }
+
+#endif
+
+
+
+  bool AllocStats::enabled ()
+  {
+#ifdef MRTRIX_ALLOC_STATS
+    return true;
+#else
+    return false;
+#endif
+  }
+
+
+
+  void AllocStats::read (uint64_t& count, uint64_t& bytes)
+  {
+#ifdef MRTRIX_ALLOC_STATS
+    count = thread_counts.count;
+    bytes = thread_counts.bytes;
+#else
+    count = bytes = 0;
+#endif
+  }
+
+
+
+  vector<AllocStats::HotRegionCount> AllocStats::hot_regions ()
+  {
+    vector<HotRegionCount> regions;
+#ifdef MRTRIX_ALLOC_STATS
+    for (size_t n = 0; n < ALLOC_STATS_MAX_HOT_REGIONS && hot_region_slots[n].name.load(); ++n)
+      regions.push_back ({ hot_region_slots[n].name.load(), hot_region_slots[n].count.load(), hot_region_slots[n].bytes.load() });
+#endif
+    return regions;
+  }
+
+}
+
+
+
+#ifdef MRTRIX_ALLOC_STATS
+
+// replacements for the allocation functions of the C library, forwarding to its
+// internal entry points (memory is released by the unmodified free())
+extern "C" {
+
+  void* __libc_malloc (size_t size);
+  void* __libc_calloc (size_t num, size_t size);
+  void* __libc_realloc (void* ptr, size_t size);
+  void* __libc_memalign (size_t alignment, size_t size);
+
+  void* malloc (size_t size)
+  {
+    MR::record (size);
+    return __libc_malloc (size);
+  }
+
+  void* calloc (size_t num, size_t size)
+  {
+    MR::record (num * size);
+    return __libc_calloc (num, size);
+  }
+
+  void* realloc (void* ptr, size_t size)
+  {
+    MR::record (size);
+    return __libc_realloc (ptr, size);
+  }
+
+  void* memalign (size_t alignment, size_t size)
+  {
+    MR::record (size);
+    return __libc_memalign (alignment, size);
+  }
+
+  void* aligned_alloc (size_t alignment, size_t size)
+  {
+    MR::record (size);
+    return __libc_memalign (alignment, size);
+  }
+
+  int posix_memalign (void** ptr, size_t alignment, size_t size)
+  {
+    MR::record (size);
+    *ptr = __libc_memalign (alignment, size);
+    return *ptr ? 0 : ENOMEM;
+  }
+
+}
+
+#endif
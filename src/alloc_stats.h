@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __alloc_stats_h__
+#define __alloc_stats_h__
+
+#include <cstdint>
+
+#include "mrtrix.h"
+
+// maximum number of distinct hot regions in which allocations can be recorded
+#define ALLOC_STATS_MAX_HOT_REGIONS 32
+
+namespace MR
+{
+
+  //! Count the heap allocations made by each thread, and flag those made within hot regions
+  /*! This is only active in builds with MRTRIX_ALLOC_STATS defined (e.g.
+   * configured with CFLAGS="-DMRTRIX_ALLOC_STATS"), and only with the GNU C
+   * library: the allocation functions of the C library (malloc(), calloc(),
+   * realloc() and the aligned variants, through which operator new and the
+   * Eigen allocator also go) are then replaced by versions that count the
+   * number of allocations and bytes requested by the calling thread, before
+   * forwarding to the C library. Memory is not tracked beyond that (in
+   * particular, calls to free() are not counted).
+   *
+   * A hot region is delimited by the lifetime of a HotRegion object, placed
+   * in code that is expected not to allocate, such as the per-voxel functor
+   * of a loop; any allocation within it is recorded against the region name.
+   * In other builds, HotRegion objects compile to nothing, and no counts are
+   * recorded.
+   *
+   * The counts are reported per phase and per thread by Timings. */
+  class AllocStats { NOMEMALIGN
+    public:
+#ifdef MRTRIX_ALLOC_STATS
+      class HotRegion { NOMEMALIGN
+        public:
+          HotRegion (const char* name);
+          ~HotRegion ();
+        protected:
+          const char* previous;
+      };
+#else
+      class HotRegion { NOMEMALIGN
+        public:
+          HotRegion (const char*) { }
+      };
+#endif
+
+      struct HotRegionCount { NOMEMALIGN
+        const char* name;
+        uint64_t count, bytes;
+      };
+
+      //! whether allocations are being counted
+      static bool enabled ();
+
+      //! the number of allocations and bytes requested by the calling thread since it started
+      static void read (uint64_t& count, uint64_t& bytes);
+
+      //! the allocations recorded in each hot region (by all threads) since the start of the program
+      static vector<HotRegionCount> hot_regions ();
+  };
+
+}
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __content_hash_h__
+#define __content_hash_h__
+
+#include <atomic>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#include "mrtrix.h"
+#include "huge_pages.h"
+#include "image_helpers.h"
+#include "thread_pool.h"
+#include "algo/loop.h"
+
+namespace MR
+{
+
+  //! A 128-bit (non-cryptographic) hash of arbitrary content: MurmurHash3 (x64, 128-bit variant)
+  /*! This is intended to identify content (e.g. the data of a set of images)
+   * for caching purposes, where no protection against deliberate collisions
+   * is required. The hash is computed incrementally, and is identical to that
+   * of the reference implementation (MurmurHash3_x64_128) over the
+   * concatenation of all content passed to update(), with the given seed.
+   *
+   * Reference values, as given by hex() after update (data, size) (in any
+   * number of parts) with the seed shown:
+   * - "" (seed 0): 00000000000000000000000000000000
+   * - "hello" (seed 0): cbd8a7b341bd9b025b1e906a48ae1d19
+   * - "The quick brown fox jumps over the lazy dog" (seed 0): e34bbc7bbc071b6c7a433ca9c49a9347
+   * - "The quick brown fox jumps over the lazy dog" (seed 42): 740dcf93fe0bd5d7c4546cf4ec705c8f
+   *
+   * Note that update (text) also adds the length of the string, and so
+   * does not give these values. */
+  class ContentHash { NOMEMALIGN
+    public:
+      ContentHash (uint64_t seed = 0) : h1 (seed), h2 (seed), length (0), tail_length (0) { }
+
+      void update (const void* data, size_t size) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*> (data);
+        length += size;
+        if (tail_length) {
+          const size_t n = std::min (size, 16 - tail_length);
+          memcpy (tail + tail_length, p, n);
+          tail_length += n; p += n; size -= n;
+          if (tail_length < 16)
+            return;
+          block (tail);
+          tail_length = 0;
+        }
+        for (; size >= 16; size -= 16, p += 16)
+          block (p);
+        memcpy (tail, p, size);
+        tail_length = size;
+      }
+
+      void update (const std::string& text) {
+        update (text.data(), text.size());
+        update_value (uint64_t (text.size()));
+      }
+
+      template <typename T>
+      void update_value (const T& value) {
+        update (&value, sizeof (T));
+      }
+
+      //! the hash of the content so far, as two 64-bit words (h1, h2 of the reference implementation)
+      std::pair<uint64_t, uint64_t> digest () const {
+        uint64_t d1 = h1, d2 = h2, k1 = 0, k2 = 0;
+        for (size_t n = tail_length; n > 8; --n)
+          k2 = (k2 << 8) | tail[n-1];
+        for (size_t n = std::min<size_t> (tail_length, 8); n > 0; --n)
+          k1 = (k1 << 8) | tail[n-1];
+        if (tail_length > 8)
+          d2 ^= rotl (k2 * c2, 33) * c1;
+        if (tail_length)
+          d1 ^= rotl (k1 * c1, 31) * c2;
+        d1 ^= length; d2 ^= length;
+        d1 += d2; d2 += d1;
+        d1 = fmix (d1); d2 = fmix (d2);
+        d1 += d2; d2 += d1;
+        return { d1, d2 };
+      }
+
+      //! the hash, as a string of 32 hexadecimal digits
+      std::string hex () const {
+        const auto d = digest();
+        std::ostringstream stream;
+        stream << std::hex << std::setfill ('0') << std::setw (16) << d.first << std::setw (16) << d.second;
+        return stream.str();
+      }
+
+    protected:
+      static constexpr uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+      uint64_t h1, h2, length;
+      uint8_t tail[16];
+      size_t tail_length;
+
+      static FORCE_INLINE uint64_t rotl (uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+      static FORCE_INLINE uint64_t fmix (uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        return k ^ (k >> 33);
+      }
+
+      // (blocks are read as little-endian words, as on the platforms supported)
+      FORCE_INLINE void block (const uint8_t* p) {
+        uint64_t k1, k2;
+        memcpy (&k1, p, 8);
+        memcpy (&k2, p + 8, 8);
+        h1 ^= rotl (k1 * c1, 31) * c2;
+        h1 = rotl (h1, 27) + h2;
+        h1 = h1 * 5 + 0x52dce729;
+        h2 ^= rotl (k2 * c2, 33) * c1;
+        h2 = rotl (h2, 31) + h1;
+        h2 = h2 * 5 + 0x38495ab5;
+      }
+  };
+
+
+
+  //! add the contents of an image to a hash, hashing separate chunks of the image in parallel
+  /*! The image is divided into chunks, hashed separately by the threads of
+   * the shared pool; the digests of the chunks are then added to the hash in
+   * turn. Images whose buffer is directly accessible (see
+   * image_buffer_bytes()) are hashed as raw bytes, in chunks of 4 MB; other
+   * images (e.g. bitwise masks) value by value, one slice per chunk. The
+   * chunks do not depend on the number of threads, and nor does the hash. */
+  template <class ImageType>
+    inline void update_image (ContentHash& hash, ImageType image)
+    {
+      const size_t bytes = image_buffer_bytes (image);
+      const size_t chunk_bytes = 4 << 20;
+      const size_t num_chunks = bytes ? (bytes + chunk_bytes - 1) / chunk_bytes : image.size(2);
+      vector<std::pair<uint64_t, uint64_t>> digests (num_chunks);
+      const uint8_t* buffer = bytes ? reinterpret_cast<const uint8_t*> (image.address()) : nullptr;
+      std::atomic<size_t> next (0);
+
+      ThreadPool::shared().run ([&] (size_t) {
+          ImageType copy (image);
+          size_t n;
+          while ((n = next++) < num_chunks) {
+            ContentHash chunk;
+            if (buffer) {
+              chunk.update (buffer + n * chunk_bytes, std::min (chunk_bytes, bytes - n * chunk_bytes));
+            }
+            else {
+              copy.index(2) = n;
+              for (auto l = Loop (0, 2) (copy); l; ++l) {
+                if (copy.ndim() > 3) {
+                  for (auto v = Loop (3, copy.ndim()) (copy); v; ++v)
+                    chunk.update_value (copy.value());
+                }
+                else
+                  chunk.update_value (copy.value());
+              }
+            }
+            digests[n] = chunk.digest();
+          }
+        });
+
+      hash.update_value (uint64_t (bytes));
+      for (const auto& digest : digests) {
+        hash.update_value (digest.first);
+        hash.update_value (digest.second);
+      }
+    }
+
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "huge_pages.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+#include "file/config.h"
+
+#ifdef __linux__
+# include <sys/mman.h>
+#endif
+
+// the size of a (transparent) huge page on x86-64 and most other platforms
+#define HUGE_PAGE_BYTES (size_t (2) << 20)
+
+namespace MR
+{
+
+  //CONF option: HugePages
+  //CONF default: 0 (false)
+  //CONF Whether to back the scratch images (and images held in memory) of
+  //CONF the mtnormalise and icls commands with transparent huge pages
+  //CONF (Linux only), which reduces the TLB misses incurred by passes over
+  //CONF large images.
+
+  namespace
+  {
+    // -1 until set by HugePages::request(), in which case the config entry is used
+    int huge_pages_requested = -1;
+
+    struct Buffer { NOMEMALIGN
+      std::string description;
+      size_t bytes;
+      std::string error;
+    };
+    vector<Buffer> buffers;
+
+    // the amount of memory of the process backed by (anonymous and file) huge pages, from /proc/self/smaps_rollup
+    size_t huge_page_bytes ()
+    {
+      std::ifstream in ("/proc/self/smaps_rollup");
+      size_t total = 0;
+      std::string line;
+      while (std::getline (in, line)) {
+        if (line.compare (0, 14, "AnonHugePages:") && line.compare (0, 15, "FilePmdMapped:") && line.compare (0, 15, "ShmemPmdMapped:"))
+          continue;
+        total += std::stoull (line.substr (line.find (':') + 1)) << 10;
+      }
+      return total;
+    }
+  }
+
+
+
+  void HugePages::request (bool huge_pages)
+  {
+    huge_pages_requested = huge_pages;
+  }
+
+  bool HugePages::requested ()
+  {
+    if (huge_pages_requested < 0)
+      huge_pages_requested = File::Config::get_bool ("HugePages", false);
+    return huge_pages_requested;
+  }
+
+
+
+  bool HugePages::available ()
+  {
+#ifdef __linux__
+    static const bool enabled = [] {
+      std::ifstream in ("/sys/kernel/mm/transparent_hugepage/enabled");
+      std::string mode;
+      if (!std::getline (in, mode))
+        return false;
+      return mode.find ("[never]") == std::string::npos;
+    }();
+    return enabled;
+#else
+    return false;
+#endif
+  }
+
+
+
+  bool HugePages::advise (void* address, size_t bytes, const std::string& description)
+  {
+    if (!requested())
+      return false;
+    if (!available()) {
+      static bool warned = false;
+      if (!warned)
+        WARN ("transparent huge pages are unavailable (disabled, or unsupported by the system) - normal pages will be used");
+      warned = true;
+      buffers.push_back ({ description, bytes, "unavailable" });
+      return false;
+    }
+#ifdef __linux__
+    const size_t start = reinterpret_cast<size_t> (address);
+    const size_t first = (start + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+    const size_t last = (start + bytes) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+    if (last <= first) {
+      buffers.push_back ({ description, bytes, "smaller than a huge page" });
+      return false;
+    }
+    if (madvise (reinterpret_cast<void*> (first), last - first, MADV_HUGEPAGE)) {
+      buffers.push_back ({ description, bytes, strerror (errno) });
+      DEBUG ("huge pages unavailable for " + description + ": " + strerror (errno));
+      return false;
+    }
+    buffers.push_back ({ description, last - first, std::string() });
+    return true;
+#else
+    return false;
+#endif
+  }
+
+
+
+  void HugePages::report ()
+  {
+    if (!requested())
+      return;
+    for (const auto& b : buffers) {
+      if (b.error.empty())
+        INFO ("huge pages requested for " + b.description + " (" + str(b.bytes >> 20) + " MB)");
+      else
+        INFO ("normal pages used for " + b.description + " (" + str(b.bytes >> 20) + " MB): " + b.error);
+    }
+    INFO ("memory currently backed by huge pages: " + str(huge_page_bytes() >> 20) + " MB");
+  }
+
+}
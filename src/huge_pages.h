@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __huge_pages_h__
+#define __huge_pages_h__
+
+#include "mrtrix.h"
+#include "image_helpers.h"
+
+namespace MR
+{
+
+  //! Backing of large image buffers with transparent huge pages (Linux only)
+  /*! If requested (by a command option, or by the HugePages config entry),
+   * the buffers of large images are marked with madvise (MADV_HUGEPAGE), so
+   * that the system backs them with huge pages (usually 2 MB, rather than
+   * 4 kB), which reduces the number of TLB misses incurred by passes over the
+   * whole image (as measured by the "dTLB misses" counter of PerfCounters).
+   * Only the whole huge pages within a buffer are marked.
+   *
+   * This applies to anonymous memory, i.e. scratch images and images held in
+   * memory (see first_touch(), which also releases the pages already
+   * allocated, so that they are allocated again as huge pages); for
+   * memory-mapped image files, this is only supported on some filesystems
+   * (e.g. tmpfs mounted with the huge option), and the buffer otherwise
+   * falls back to normal pages. Huge pages are unavailable if transparent
+   * huge pages are disabled system-wide (as set in
+   * /sys/kernel/mm/transparent_hugepage/enabled), in which case a warning is
+   * issued.
+   *
+   * The buffers marked (or not) are recorded, and reported by report(),
+   * along with the amount of memory of the process actually backed by huge
+   * pages. This is not thread-safe: buffers must be marked from the main
+   * thread. */
+  class HugePages { NOMEMALIGN
+    public:
+      //! request huge pages for the buffers subsequently marked (the default is set by the HugePages config entry)
+      static void request (bool huge_pages);
+      //! whether huge pages are requested
+      static bool requested ();
+
+      //! whether transparent huge pages are enabled system-wide (in "always" or "madvise" mode)
+      static bool available ();
+
+      //! mark the whole huge pages within the given buffer, if requested: returns whether this succeeded
+      static bool advise (void* address, size_t bytes, const std::string& description);
+
+      //! report the buffers marked, and the memory currently backed by huge pages (at -info)
+      static void report ();
+  };
+
+
+
+  //! the extent (in bytes) of the buffer of an image that is directly accessible in memory, or zero
+  /*! This sets the index of the image to zero along all axes; on return,
+   * address() is then the start of the buffer (for images with positive
+   * strides, as is the case for scratch images and newly created images). */
+  template <class ImageType>
+    inline size_t image_buffer_bytes (ImageType& image)
+    {
+      bool contiguous = image.is_direct_io();
+      for (size_t n = 0; n < image.ndim(); ++n) {
+        contiguous = contiguous && image.stride(n) > 0;
+        image.index(n) = 0;
+      }
+      return contiguous && image.address() ? voxel_count (image) * sizeof (typename ImageType::value_type) : 0;
+    }
+
+  //! mark the buffer of an image (e.g. one that is memory-mapped) to be backed by huge pages, if requested
+  template <class ImageType>
+    inline bool huge_pages (ImageType& image, const std::string& description)
+    {
+      if (!HugePages::requested())
+        return false;
+      const size_t bytes = image_buffer_bytes (image);
+      return bytes && HugePages::advise (image.address(), bytes, description);
+    }
+
+}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "memory_plan.h"
+
+#include "file/path.h"
+#include "parallel_gzip.h"
+
+namespace MR
+{
+
+  namespace
+  {
+    std::string megabytes (size_t bytes)
+    {
+      return printf ("%10.1f MB", bytes / double (1 << 20));
+    }
+  }
+
+
+
+  void MemoryPlan::add_image (const std::string& description, const Header& header, const std::string& path)
+  {
+    const size_t bytes = voxel_count (header) * header.datatype().bytes();
+    if (held_in_memory (path))
+      add (description + " (compressed, held in memory)", bytes);
+    else if (ParallelGZ::compressed (path) && ParallelGZ::in_memory (path, bytes))
+      add (description + " (compressed, decompressed into memory)", bytes);
+    else if (ParallelGZ::compressed (path) && ScratchFiles::memory_directory().size())
+      mapped.push_back ({ description + " (compressed, via temporary file: insufficient space in memory)", bytes });
+    else if (ParallelGZ::compressed (path))
+      mapped.push_back ({ description + " (compressed, via temporary file)", bytes });
+    else
+      mapped.push_back ({ description, bytes });
+  }
+
+
+
+  size_t MemoryPlan::peak_bytes () const
+  {
+    size_t total = 0;
+    for (const auto& b : buffers)
+      total += b.second;
+    return total;
+  }
+
+  double MemoryPlan::run_time () const
+  {
+    double total = 0.0;
+    for (const auto& p : passes)
+      total += p.second;
+    return total;
+  }
+
+
+
+  void MemoryPlan::print () const
+  {
+    if (strategy.size())
+      CONSOLE ("execution strategy: " + strategy);
+    CONSOLE ("estimated peak memory: " + megabytes (peak_bytes()));
+    for (const auto& b : buffers)
+      CONSOLE (printf ("  %-56s %s", b.first.c_str(), megabytes (b.second).c_str()));
+    if (mapped.size()) {
+      CONSOLE ("memory-mapped files (not included above; reclaimable by the system):");
+      for (const auto& m : mapped)
+        CONSOLE (printf ("  %-56s %s", m.first.c_str(), megabytes (m.second).c_str()));
+    }
+    CONSOLE (printf ("estimated run time: %10.1f s", run_time()));
+    for (const auto& p : passes)
+      CONSOLE (printf ("  %-56s %10.1f s", p.first.c_str(), p.second));
+  }
+
+
+
+  bool MemoryPlan::held_in_memory (const std::string& path)
+  {
+    return ParallelGZ::compressed (path) && !ParallelGZ::enabled();
+  }
+
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __memory_plan_h__
+#define __memory_plan_h__
+
+#include "mrtrix.h"
+#include "header.h"
+
+namespace MR
+{
+
+  //! An estimate of the peak memory use and run time of a command, made before its data are loaded
+  /*! The estimate is built up from the buffers that the command holds at the
+   * same time, so that the peak is their sum, and from the passes it makes
+   * over the data, each given an estimated duration by the command (usually
+   * from nominal per-voxel rates, so that only its order of magnitude is
+   * meaningful).
+   *
+   * Image files are either accessed in place, through a memory map whose
+   * pages the system can reclaim under memory pressure (listed, but not
+   * included in the peak, as are other buffers backed by memory-mapped
+   * files), or held in memory in their entirety, as is the case for
+   * compressed images (by the image backend, or as temporary files in a
+   * memory-backed filesystem, see ParallelGZ). */
+  class MemoryPlan { NOMEMALIGN
+    public:
+      MemoryPlan (const std::string& strategy = std::string()) : strategy (strategy) { }
+
+      //! a buffer held for (at least part of) the peak
+      void add (const std::string& description, size_t bytes) { buffers.push_back ({ description, bytes }); }
+      //! an image file, with the given header and path
+      void add_image (const std::string& description, const Header& header, const std::string& path);
+      //! a buffer backed by a memory-mapped file (such as a file-backed scratch image)
+      void add_mapped (const std::string& description, size_t bytes) { mapped.push_back ({ description, bytes }); }
+      //! a pass over the data, of the given estimated duration
+      void add_pass (const std::string& description, double seconds) { passes.push_back ({ description, seconds }); }
+
+      size_t peak_bytes () const;
+      double run_time () const;
+
+      //! print the estimate to the console
+      void print () const;
+
+      //! whether an image file is held in memory in its entirety, rather than memory-mapped
+      static bool held_in_memory (const std::string& path);
+
+      std::string strategy;
+
+    protected:
+      vector<std::pair<std::string, size_t>> buffers, mapped;
+      vector<std::pair<std::string, double>> passes;
+  };
+
+}
+
+#endif
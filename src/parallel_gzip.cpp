@@ -0,0 +1,693 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "parallel_gzip.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <zlib.h>
+
+#include "thread.h"
+#include "thread_pool.h"
+#include "file/config.h"
+#include "file/path.h"
+
+// the size of the uncompressed blocks, each compressed into a separate gzip member
+#define PARALLEL_GZIP_BLOCK_BYTES (size_t (1) << 20)
+// the number of blocks per thread that may be in flight at any time
+#define PARALLEL_GZIP_BLOCKS_PER_THREAD 2
+
+// the header of each gzip member written: the fixed header (10 bytes) with the FEXTRA flag set, the
+// length of the extra field (2 bytes), and a single subfield ('M','R'; 2 bytes of length) holding
+// the size (4 bytes, little-endian) of the whole member, including its header and trailer (8 bytes)
+#define PARALLEL_GZIP_HEADER_BYTES 20
+#define PARALLEL_GZIP_TRAILER_BYTES 8
+
+namespace MR
+{
+
+  //CONF option: ParallelGzip
+  //CONF default: 1 (true)
+  //CONF Whether compressed images (.mif.gz, .nii.gz, .mgz) read or written by
+  //CONF the mtnormalise and icls commands are decompressed into (or written
+  //CONF to, and compressed from) temporary files (held in memory where
+  //CONF possible), in blocks compressed by all threads concurrently and in
+  //CONF the background while the data are processed, rather than held in
+  //CONF memory and (de)compressed by a single thread.
+
+  namespace
+  {
+
+    void put_le (std::string& buffer, size_t offset, uint32_t value, size_t bytes)
+    {
+      for (size_t n = 0; n < bytes; ++n)
+        buffer[offset + n] = char ((value >> (8*n)) & 0xFF);
+    }
+
+    uint32_t get_le (const std::string& buffer, size_t offset, size_t bytes)
+    {
+      uint32_t value = 0;
+      for (size_t n = 0; n < bytes; ++n)
+        value |= uint32_t (uint8_t (buffer[offset + n])) << (8*n);
+      return value;
+    }
+
+
+
+    using Job = std::function<void(size_t)>;
+
+    // Run a job on threads of its own (rather than those of the shared pool, which may only be run
+    // from the main thread), rethrowing the first exception thrown by any of them
+    void run_threads (size_t num_threads, const Job& job)
+    {
+      std::mutex mutex;
+      std::exception_ptr error;
+      vector<std::thread> threads;
+      for (size_t n = 0; n < num_threads; ++n) {
+        threads.emplace_back ([&, n] {
+          try {
+            job (n);
+          }
+          catch (...) {
+            std::lock_guard<std::mutex> lock (mutex);
+            if (!error)
+              error = std::current_exception();
+          }
+        });
+      }
+      for (auto& thread : threads)
+        thread.join();
+      if (error)
+        std::rethrow_exception (error);
+    }
+
+
+
+    // Run a pipeline over the blocks of a file: the blocks are read in turn (by read(), which returns
+    // false once there are no more), transformed by num_threads threads concurrently (as run by run()),
+    // and written in turn (by write()), with at most PARALLEL_GZIP_BLOCKS_PER_THREAD blocks per thread in flight
+    void pipeline (size_t num_threads, const std::function<void(const Job&)>& run,
+                   const std::function<bool(std::string&)>& read,
+                   const std::function<void(const std::string&, std::string&)>& transform,
+                   const std::function<void(const std::string&)>& write)
+    {
+      const size_t window = PARALLEL_GZIP_BLOCKS_PER_THREAD * num_threads;
+      std::mutex mutex;
+      std::condition_variable ready;
+      size_t next = 0, written = 0;
+      bool end = false, failed = false;
+      std::map<size_t, std::string> completed;
+
+      run ([&] (size_t) {
+        std::string in, out;
+        while (true) {
+          size_t index;
+          {
+            std::unique_lock<std::mutex> lock (mutex);
+            ready.wait (lock, [&] { return end || failed || next < written + window; });
+            if (end || failed)
+              return;
+            try {
+              if (!read (in)) {
+                end = true;
+                ready.notify_all();
+                return;
+              }
+            }
+            catch (...) {
+              failed = true;
+              ready.notify_all();
+              throw;
+            }
+            index = next++;
+          }
+
+          try {
+            transform (in, out);
+          }
+          catch (...) {
+            std::lock_guard<std::mutex> lock (mutex);
+            failed = true;
+            ready.notify_all();
+            throw;
+          }
+
+          std::lock_guard<std::mutex> lock (mutex);
+          if (failed)
+            return;
+          completed[index].swap (out);
+          try {
+            for (auto block = completed.find (written); block != completed.end(); block = completed.find (written)) {
+              write (block->second);
+              completed.erase (block);
+              ++written;
+            }
+          }
+          catch (...) {
+            failed = true;
+            ready.notify_all();
+            throw;
+          }
+          ready.notify_all();
+        }
+      });
+    }
+
+
+
+    // Compress a block into a single gzip member, recording its size in the extra field
+    void deflate_block (const std::string& in, std::string& out)
+    {
+      z_stream stream;
+      memset (&stream, 0, sizeof (stream));
+      if (deflateInit2 (&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw Exception ("error initialising gzip compression");
+      out.resize (PARALLEL_GZIP_HEADER_BYTES + deflateBound (&stream, in.size()) + PARALLEL_GZIP_TRAILER_BYTES);
+      stream.next_in = reinterpret_cast<Bytef*> (const_cast<char*> (in.data()));
+      stream.avail_in = in.size();
+      stream.next_out = reinterpret_cast<Bytef*> (&out[PARALLEL_GZIP_HEADER_BYTES]);
+      stream.avail_out = out.size() - PARALLEL_GZIP_HEADER_BYTES - PARALLEL_GZIP_TRAILER_BYTES;
+      const int result = deflate (&stream, Z_FINISH);
+      const size_t compressed_bytes = stream.total_out;
+      deflateEnd (&stream);
+      if (result != Z_STREAM_END)
+        throw Exception ("error compressing data");
+
+      const size_t size = PARALLEL_GZIP_HEADER_BYTES + compressed_bytes + PARALLEL_GZIP_TRAILER_BYTES;
+      // ID1, ID2, CM (deflate), FLG (FEXTRA), MTIME (none), XFL, OS (unknown)
+      const char header[] = { char (0x1f), char (0x8b), 8, 4, 0, 0, 0, 0, 0, char (255) };
+      out.replace (0, 10, header, 10);
+      put_le (out, 10, 8, 2);
+      out[12] = 'M';
+      out[13] = 'R';
+      put_le (out, 14, 4, 2);
+      put_le (out, 16, size, 4);
+      const size_t trailer = PARALLEL_GZIP_HEADER_BYTES + compressed_bytes;
+      put_le (out, trailer, crc32 (crc32 (0, Z_NULL, 0), reinterpret_cast<const Bytef*> (in.data()), in.size()), 4);
+      put_le (out, trailer + 4, in.size(), 4);
+      out.resize (size);
+    }
+
+    // Decompress a block of one or more complete gzip members
+    void inflate_block (const std::string& in, std::string& out)
+    {
+      z_stream stream;
+      memset (&stream, 0, sizeof (stream));
+      // (with automatic detection and checking of the gzip header and trailer)
+      if (inflateInit2 (&stream, MAX_WBITS + 16) != Z_OK)
+        throw Exception ("error initialising gzip decompression");
+      // the uncompressed size of the last member, from its trailer, as an initial estimate of the size of the block
+      out.resize (std::max<size_t> (in.size() >= 4 ? get_le (in, in.size() - 4, 4) : 0, 2 * in.size() + 1));
+      stream.next_in = reinterpret_cast<Bytef*> (const_cast<char*> (in.data()));
+      stream.avail_in = in.size();
+      size_t total = 0;
+      while (true) {
+        stream.next_out = reinterpret_cast<Bytef*> (&out[total]);
+        stream.avail_out = out.size() - total;
+        const int result = inflate (&stream, Z_NO_FLUSH);
+        total = out.size() - stream.avail_out;
+        if (result == Z_STREAM_END) {
+          if (!stream.avail_in)
+            break;
+          inflateReset (&stream);
+        }
+        else if (result == Z_BUF_ERROR && !stream.avail_in) {
+          inflateEnd (&stream);
+          throw Exception ("unexpected end of compressed data");
+        }
+        else if (result != Z_OK && result != Z_BUF_ERROR) {
+          inflateEnd (&stream);
+          throw Exception ("error decompressing data: " + std::string (stream.msg ? stream.msg : "corrupt data"));
+        }
+        if (total == out.size())
+          out.resize (2 * out.size());
+      }
+      inflateEnd (&stream);
+      out.resize (total);
+    }
+
+
+
+    // Read the next gzip member whose size is recorded in its header (as written by deflate_block()),
+    // or otherwise the remainder of the file; returns false at the end of the file
+    bool read_member (std::ifstream& in, std::string& block)
+    {
+      const auto start = in.tellg();
+      block.resize (PARALLEL_GZIP_HEADER_BYTES);
+      in.read (&block[0], PARALLEL_GZIP_HEADER_BYTES);
+      const size_t header_bytes = in.gcount();
+      if (!header_bytes)
+        return false;
+      size_t size = 0;
+      if (header_bytes == PARALLEL_GZIP_HEADER_BYTES && uint8_t (block[0]) == 0x1f && uint8_t (block[1]) == 0x8b &&
+          (block[3] & 4) && get_le (block, 10, 2) == 8 && block[12] == 'M' && block[13] == 'R' && get_le (block, 14, 2) == 4)
+        size = get_le (block, 16, 4);
+      if (size >= PARALLEL_GZIP_HEADER_BYTES + PARALLEL_GZIP_TRAILER_BYTES) {
+        block.resize (size);
+        in.read (&block[PARALLEL_GZIP_HEADER_BYTES], size - PARALLEL_GZIP_HEADER_BYTES);
+        if (size_t (in.gcount()) != size - PARALLEL_GZIP_HEADER_BYTES)
+          throw Exception ("unexpected end of compressed data");
+        return true;
+      }
+      in.clear();
+      in.seekg (start);
+      return false;
+    }
+
+
+
+    // Whether a gzip file was written in blocks (i.e. its first member records its size)
+    bool written_in_blocks (const std::string& path)
+    {
+      std::ifstream in (path, std::ios::in | std::ios::binary);
+      if (!in)
+        throw Exception ("error opening compressed image \"" + path + "\": " + strerror (errno));
+      std::string first;
+      return read_member (in, first);
+    }
+
+
+
+    // The decompression of a gzip file into a new file by a thread of its own (and, for files written
+    // in blocks, the threads of its pipeline), publishing the number of bytes written so far
+    class Decompression { NOMEMALIGN
+      public:
+        Decompression (const std::string& source, const std::string& destination, bool blocks) :
+            source (source), destination (destination), data_offset (0), total (0), bytes_per_value (0),
+            written (0), done (false), cancelled (false),
+            thread (&Decompression::run, this, blocks) { }
+
+        ~Decompression () {
+          cancelled = true;
+          thread.join();
+        }
+
+        // wait until at least the given number of bytes have been written (or all, if fewer), returning the number written
+        size_t wait (size_t bytes) {
+          std::unique_lock<std::mutex> lock (mutex);
+          changed.wait (lock, [&] { return written >= bytes || done; });
+          if (error)
+            std::rethrow_exception (error);
+          return written;
+        }
+
+        size_t wait_all () {
+          const size_t bytes = wait (std::numeric_limits<size_t>::max());
+          if (bytes < total)
+            throw Exception ("unexpected end of data in compressed image \"" + source + "\"");
+          return bytes;
+        }
+
+        // the number of bytes of the file required for the slices [z_begin, z_end) of the image, i.e. up to
+        // the last value within these slices (with the offset of each value relative to the first voxel
+        // given by the strides, possibly negative)
+        size_t bytes_required (ssize_t z_begin, ssize_t z_end) const {
+          ssize_t origin = 0, last = 0;
+          for (size_t n = 0; n < sizes.size(); ++n) {
+            if (strides[n] < 0)
+              origin -= (sizes[n] - 1) * strides[n];
+            if (n == 2)
+              last += strides[n] > 0 ? (z_end - 1) * strides[n] : z_begin * strides[n];
+            else if (strides[n] > 0)
+              last += (sizes[n] - 1) * strides[n];
+          }
+          return data_offset + (origin + last + 1) * bytes_per_value;
+        }
+
+        const std::string source, destination;
+        // the offset of the image data, and size of the whole file (zero if not known, in which case the
+        // image is only accessed once complete), and the layout of the image as opened
+        size_t data_offset, total;
+        vector<ssize_t> sizes, strides;
+        size_t bytes_per_value;
+
+      protected:
+        std::mutex mutex;
+        std::condition_variable changed;
+        size_t written;
+        bool done;
+        std::exception_ptr error;
+        std::atomic<bool> cancelled;
+        std::thread thread;
+
+        void run (bool blocks) {
+          try {
+            std::ifstream in (source, std::ios::in | std::ios::binary);
+            if (!in)
+              throw Exception ("error opening compressed image \"" + source + "\": " + strerror (errno));
+            std::ofstream out (destination, std::ios::out | std::ios::binary);
+            if (!out)
+              throw Exception ("error creating temporary file \"" + destination + "\": " + strerror (errno));
+            // (each block is flushed as soon as written, and is then visible through any mapping of the file)
+            auto write = [&] (const std::string& block) {
+              out.write (block.data(), block.size());
+              out.flush();
+              if (!out)
+                throw Exception ("error writing temporary file \"" + destination + "\": " + strerror (errno));
+              std::lock_guard<std::mutex> lock (mutex);
+              written += block.size();
+              changed.notify_all();
+            };
+
+            if (blocks) {
+              bool read_remainder = false;
+              const size_t num_threads = std::max<size_t> (1, Thread::number_of_threads());
+              pipeline (num_threads, [num_threads] (const Job& job) { run_threads (num_threads, job); },
+                        [&] (std::string& block) {
+                          if (read_remainder || cancelled)
+                            return false;
+                          if (read_member (in, block))
+                            return true;
+                          // the remainder of the file (e.g. if appended by another tool), as a single block
+                          block.assign (std::istreambuf_iterator<char> (in), std::istreambuf_iterator<char>());
+                          read_remainder = true;
+                          return block.size() > 0;
+                        },
+                        inflate_block, write);
+            }
+            else {
+              gzFile gz = gzopen (source.c_str(), "rb");
+              if (!gz)
+                throw Exception ("error opening compressed image \"" + source + "\"");
+              std::string buffer (PARALLEL_GZIP_BLOCK_BYTES, '\0');
+              int bytes = 0;
+              while (!cancelled && (bytes = gzread (gz, &buffer[0], buffer.size())) > 0) {
+                buffer.resize (bytes);
+                write (buffer);
+                buffer.resize (PARALLEL_GZIP_BLOCK_BYTES);
+              }
+              gzclose (gz);
+              if (bytes < 0)
+                throw Exception ("error decompressing image \"" + source + "\"");
+            }
+          }
+          catch (...) {
+            std::lock_guard<std::mutex> lock (mutex);
+            error = std::current_exception();
+          }
+          std::lock_guard<std::mutex> lock (mutex);
+          done = true;
+          changed.notify_all();
+        }
+    };
+
+    // the decompressions started, by the path of the file decompressed into (each joined on exit, if not complete)
+    std::mutex decompressions_mutex;
+    std::map<std::string, std::unique_ptr<Decompression>> decompressions;
+
+    Decompression* find_decompression (const std::string& destination)
+    {
+      std::lock_guard<std::mutex> lock (decompressions_mutex);
+      auto entry = decompressions.find (destination);
+      return entry == decompressions.end() ? nullptr : entry->second.get();
+    }
+
+
+
+    int32_t get_int32 (const std::string& buffer, size_t offset, bool swap)
+    {
+      const uint32_t value = get_le (buffer, offset, 4);
+      return swap ? int32_t ((value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24)) : int32_t (value);
+    }
+
+    // The offset of the image data within a file being decompressed, from its header (as soon as this is
+    // available), for the formats whose header is at the start of the file (MRtrix, NIfTI); zero otherwise
+    size_t data_offset (Decompression& decompression)
+    {
+      auto read = [&] (size_t bytes) {
+        bytes = decompression.wait (bytes);
+        std::ifstream in (decompression.destination, std::ios::in | std::ios::binary);
+        std::string header (bytes, '\0');
+        in.read (&header[0], bytes);
+        header.resize (in.gcount());
+        return header;
+      };
+
+      if (Path::has_suffix (decompression.destination, ".nii")) {
+        std::string header = read (544);
+        if (header.size() < 348)
+          return 0;
+        // (NIfTI-1 and NIfTI-2, of either byte order, as identified by the size of the header)
+        for (const bool swap : { false, true }) {
+          const int32_t header_size = get_int32 (header, 0, swap);
+          if (header_size == 348) {
+            const uint32_t bits = get_int32 (header, 108, swap);
+            float vox_offset;
+            memcpy (&vox_offset, &bits, 4);
+            return vox_offset >= 352.0f ? size_t (vox_offset) : 352;
+          }
+          if (header_size == 540 && header.size() >= 544)
+            return uint32_t (get_int32 (header, 168, swap)) | (size_t (uint32_t (get_int32 (header, 172, swap))) << 32);
+        }
+        return 0;
+      }
+
+      if (Path::has_suffix (decompression.destination, ".mif")) {
+        // (the header ends with a line "END"; the data are in the same file, at the offset given by the line "file: . offset")
+        for (size_t bytes = 4096; ; bytes *= 2) {
+          const std::string header = read (bytes);
+          const size_t end = header.find ("\nEND\n");
+          if (end != std::string::npos) {
+            const size_t file = header.rfind ("\nfile: . ", end);
+            return file == std::string::npos ? 0 : to<size_t> (header.substr (file + 9, header.find ('\n', file + 1) - file - 9));
+          }
+          if (header.size() < bytes)
+            return 0;
+        }
+      }
+
+      return 0;
+    }
+
+  }
+
+
+
+  bool ParallelGZ::enabled ()
+  {
+    static const bool enabled = File::Config::get_bool ("ParallelGzip", true);
+    return enabled;
+  }
+
+  bool ParallelGZ::compressed (const std::string& path)
+  {
+    return Path::has_suffix (path, ".gz") || Path::has_suffix (path, ".mgz");
+  }
+
+  std::string ParallelGZ::temporary (const std::string& path, bool in_memory)
+  {
+    if (Path::has_suffix (path, ".mgz"))
+      return ScratchFiles::path (".mgh", in_memory);
+    const std::string name = Path::basename (path.substr (0, path.size() - 3));
+    const size_t dot = name.rfind ('.');
+    return ScratchFiles::path (dot == std::string::npos ? std::string() : name.substr (dot), in_memory);
+  }
+
+  bool ParallelGZ::in_memory (const std::string& path, size_t bytes)
+  {
+    {
+      std::lock_guard<std::mutex> lock (decompressions_mutex);
+      for (const auto& entry : decompressions) {
+        if (entry.second->source == path)
+          return ScratchFiles::in_memory (entry.first);
+      }
+    }
+    return ScratchFiles::memory_directory().size() && ScratchFiles::memory_available() >= bytes;
+  }
+
+
+
+  std::string ParallelGZ::decompress (const std::string& source, size_t data_bytes)
+  {
+    const bool blocks = written_in_blocks (source);
+    if (!blocks)
+      INFO ("compressed image \"" + source + "\" not written in blocks - decompressing as a single stream");
+
+    auto discard = [] (const std::string& destination) {
+      {
+        std::lock_guard<std::mutex> lock (decompressions_mutex);
+        decompressions.erase (destination);
+      }
+      ScratchFiles::remove (destination);
+    };
+
+    // (into memory if there is sufficient space, or otherwise into the directory of temporary files)
+    for (const bool in_memory : { true, false }) {
+      const std::string destination = temporary (source, in_memory);
+      const bool last = !ScratchFiles::in_memory (destination);
+      ScratchFiles::remove_on_exit (destination);
+      Decompression* decompression;
+      {
+        std::lock_guard<std::mutex> lock (decompressions_mutex);
+        auto& entry = decompressions[destination];
+        entry.reset (new Decompression (source, destination, blocks));
+        decompression = entry.get();
+      }
+      try {
+        const size_t offset = data_offset (*decompression);
+        bool reserved;
+        try {
+          reserved = ScratchFiles::reserve (destination, offset + data_bytes);
+        }
+        catch (...) {
+          if (last)
+            throw;
+          INFO ("insufficient space in \"" + ScratchFiles::memory_directory() + "\" to decompress image \"" + source + "\" into memory - using a temporary file instead");
+          discard (destination);
+          continue;
+        }
+        // the image can be opened before it is complete if its header is understood, and the space of the whole file allocated
+        if (offset && reserved) {
+          decompression->data_offset = offset;
+          decompression->total = offset + data_bytes;
+        }
+        else {
+          DEBUG ("compressed image \"" + source + "\" can only be accessed once completely decompressed");
+          decompression->wait_all();
+        }
+        return destination;
+      }
+      catch (...) {
+        discard (destination);
+        throw;
+      }
+    }
+    // (not reached: the attempt in the directory of temporary files either returns or throws)
+    return std::string();
+  }
+
+  void ParallelGZ::opened (const std::string& destination, const vector<ssize_t>& sizes, const vector<ssize_t>& strides, size_t bytes_per_value)
+  {
+    Decompression* decompression = find_decompression (destination);
+    if (!decompression)
+      return;
+    decompression->sizes = sizes;
+    decompression->strides = strides;
+    decompression->bytes_per_value = bytes_per_value;
+  }
+
+  ssize_t ParallelGZ::available_slices (const std::string& name, ssize_t begin, ssize_t end)
+  {
+    Decompression* decompression = find_decompression (name);
+    if (!decompression || end <= begin)
+      return end;
+    // (the whole image is awaited if its layout is not known, e.g. for bitwise data)
+    if (!decompression->total || !decompression->bytes_per_value || decompression->sizes.size() < 3) {
+      decompression->wait_all();
+      return end;
+    }
+    const size_t required = decompression->bytes_required (begin, begin + 1);
+    const size_t available = decompression->wait (required);
+    if (available < required)
+      throw Exception ("unexpected end of data in compressed image \"" + decompression->source + "\"");
+    ssize_t slice = begin + 1;
+    while (slice < end && decompression->bytes_required (begin, slice + 1) <= available)
+      ++slice;
+    return slice;
+  }
+
+  void ParallelGZ::wait (const std::string& name)
+  {
+    Decompression* decompression = find_decompression (name);
+    if (decompression)
+      decompression->wait_all();
+  }
+
+  std::string ParallelGZ::source (const std::string& name)
+  {
+    Decompression* decompression = find_decompression (name);
+    return decompression ? decompression->source : name;
+  }
+
+
+
+  void ParallelGZ::compress (const std::string& source, const std::string& destination)
+  {
+    std::ifstream in (source, std::ios::in | std::ios::binary);
+    if (!in)
+      throw Exception ("error opening temporary file \"" + source + "\": " + strerror (errno));
+    std::ofstream out (destination, std::ios::out | std::ios::binary);
+    if (!out)
+      throw Exception ("error creating compressed image \"" + destination + "\": " + strerror (errno));
+    // (an empty file is compressed into a single, empty member)
+    bool first = true;
+    ThreadPool& pool (ThreadPool::shared());
+    pipeline (pool.size(), [&pool] (const Job& job) { pool.run (job); },
+              [&] (std::string& block) {
+                block.resize (PARALLEL_GZIP_BLOCK_BYTES);
+                in.read (&block[0], block.size());
+                block.resize (in.gcount());
+                const bool more = block.size() || first;
+                first = false;
+                return more;
+              },
+              deflate_block,
+              [&] (const std::string& block) { out.write (block.data(), block.size()); });
+    out.close();
+    if (!out)
+      throw Exception ("error writing compressed image \"" + destination + "\": " + strerror (errno));
+  }
+
+
+
+  ParallelGZ::Output::Output (const std::string& path) :
+      destination (path)
+  {
+    if (enabled() && compressed (path)) {
+      temporary = ParallelGZ::temporary (path);
+      ScratchFiles::remove_on_exit (temporary);
+    }
+  }
+
+  ParallelGZ::Output::~Output ()
+  {
+    if (temporary.size())
+      ScratchFiles::remove (temporary);
+  }
+
+  bool ParallelGZ::Output::reserve ()
+  {
+    try {
+      ScratchFiles::reserve (temporary);
+      return true;
+    }
+    catch (...) {
+      if (!ScratchFiles::in_memory (temporary))
+        throw;
+    }
+    INFO ("insufficient space in \"" + ScratchFiles::memory_directory() + "\" to write image \"" + destination + "\" in memory - using a temporary file instead");
+    ScratchFiles::remove (temporary);
+    temporary = ParallelGZ::temporary (destination, false);
+    ScratchFiles::remove_on_exit (temporary);
+    return false;
+  }
+
+  void ParallelGZ::Output::commit ()
+  {
+    if (temporary.empty())
+      return;
+    compress (temporary, destination);
+    ScratchFiles::remove (temporary);
+    temporary.clear();
+  }
+
+}
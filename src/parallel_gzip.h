@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __parallel_gzip_h__
+#define __parallel_gzip_h__
+
+#include "image.h"
+#include "scratch_file.h"
+
+namespace MR
+{
+
+  //! Block-parallel gzip compression and decompression of compressed image files (.mif.gz, .nii.gz, .mgz)
+  /*! Rather than being read or written through a single gzip stream by
+   * the image backend, a compressed image is decompressed into (or written
+   * to, and then compressed from) an uncompressed temporary image file,
+   * memory-mapped as any other image. This file is held in memory where
+   * possible (see ScratchFiles::memory_directory()), or otherwise (including
+   * if there is insufficient space in memory) in the scratch directory or
+   * that of temporary files.
+   *
+   * The file is compressed in blocks (of 1 MB), each a separate gzip member:
+   * the result is a standard gzip stream, readable by any gzip
+   * implementation (which must concatenate the members, as required by the
+   * gzip format). The size of each member is recorded in an extra field of
+   * its header, so that files written this way can also be decompressed in
+   * blocks; other files are decompressed as a single stream, which cannot
+   * be done in parallel.
+   *
+   * The blocks are read in turn, compressed or decompressed by all threads
+   * concurrently, and written in turn as soon as all previous blocks have
+   * been written, so that reading, (de)compression and writing all overlap,
+   * with only a few blocks per thread held in memory at any time.
+   *
+   * Images are decompressed in the background (each image by its own
+   * threads), so that several images are decompressed concurrently, and the
+   * slices of an image can be processed as soon as they are available (see
+   * open_image() and TiledLoopAsAvailable()), overlapping decompression with
+   * the first pass over the image.
+   *
+   * This is enabled by default, and can be disabled by the ParallelGzip
+   * config entry, in which case compressed images are handled (and held in
+   * memory) by the image backend as usual. */
+  class ParallelGZ { NOMEMALIGN
+    public:
+      //! whether compressed images are handled through block-parallel compression
+      static bool enabled ();
+      //! whether the image file is compressed
+      static bool compressed (const std::string& path);
+      //! a new temporary file name for the uncompressed contents of a compressed image file (e.g. ".mif" for ".mif.gz"),
+      //! in memory if requested and possible (see ScratchFiles::path())
+      static std::string temporary (const std::string& path, bool in_memory = true);
+      //! whether the uncompressed contents of a compressed image file of the given size are held in memory
+      /*! That is, if decompressed (see decompress()), whether into memory;
+       * otherwise, whether there is currently space for it there. */
+      static bool in_memory (const std::string& path, size_t bytes);
+
+      //! start decompressing a gzip file into a new temporary file in the background, returning its path once the image header is available
+      /*! The temporary file is removed on exit, unless removed earlier. The
+       * space of the whole image (of data_bytes bytes, following the
+       * header) is allocated, in memory if there is sufficient space there,
+       * so that the file can be opened as an image before it is complete if
+       * possible; otherwise (e.g. for formats whose header is not at the
+       * start of the file), this only returns once the file is complete. */
+      static std::string decompress (const std::string& source, size_t data_bytes);
+      //! record the layout of the image opened from a file being decompressed, as required by available_slices()
+      static void opened (const std::string& destination, const vector<ssize_t>& sizes, const vector<ssize_t>& strides, size_t bytes_per_value);
+      //! wait until the slices from begin of an image are available, returning the end of those available (up to end)
+      /*! The image is identified by its name, i.e. the path of the file
+       * being decompressed; for any other image, this returns end. */
+      static ssize_t available_slices (const std::string& name, ssize_t begin, ssize_t end);
+      //! wait until an image (identified as above) is completely available
+      static void wait (const std::string& name);
+      //! the path of the compressed image file decompressed into the file of an image (identified as above), or otherwise its name
+      static std::string source (const std::string& name);
+
+      //! compress a file into a new gzip file, in blocks
+      static void compress (const std::string& source, const std::string& destination);
+
+      //! An image file to be written: if compressed, through an uncompressed temporary file, compressed by commit()
+      /*! The temporary file is removed on destruction, or on exit. */
+      class Output { NOMEMALIGN
+        public:
+          Output (const std::string& path);
+          //! (the temporary file, if any, is then removed by the new object only)
+          Output (Output&& that) :
+              destination (std::move (that.destination)), temporary (std::move (that.temporary)) {
+            that.temporary.clear();
+          }
+          ~Output ();
+
+          //! the path of the file to be created (the temporary file, if compressed)
+          const std::string& path () const { return temporary.size() ? temporary : destination; }
+
+          //! create the image (the temporary file, with its space allocated, if compressed)
+          template <class ValueType>
+            Image<ValueType> create (const Header& header) {
+              auto image = Image<ValueType>::create (path(), header);
+              if (temporary.size() && !reserve()) {
+                image = Image<ValueType>();
+                image = Image<ValueType>::create (path(), header);
+                reserve();
+              }
+              return image;
+            }
+
+          //! compress the temporary file into the destination, once all images accessing it have been released
+          void commit ();
+
+        protected:
+          std::string destination, temporary;
+
+          // allocate the space of the temporary file: if there is insufficient space in memory, the file is
+          // removed and replaced by one in the directory of temporary files, to be created again (returns false)
+          bool reserve ();
+      };
+  };
+
+
+
+  //! open an image, decompressed in blocks into a temporary file if compressed (see ParallelGZ)
+  /*! If streamed, the image is returned as soon as its header has been
+   * decompressed, while the remainder is decompressed in the background:
+   * its data must then only be accessed once available, as determined by
+   * ParallelGZ::available_slices() or ParallelGZ::wait() (or through
+   * TiledLoopAsAvailable()). Otherwise, the image is returned once
+   * completely decompressed. */
+  template <class ValueType>
+    inline Image<ValueType> open_image (const std::string& path, bool read_write = false, bool streamed = false)
+    {
+      if (read_write || !ParallelGZ::enabled() || !ParallelGZ::compressed (path))
+        return Image<ValueType>::open (path, read_write);
+      const std::string temporary = ParallelGZ::decompress (path, footprint (Header::open (path)));
+      try {
+        auto image = Image<ValueType>::open (temporary);
+        vector<ssize_t> sizes, strides;
+        for (size_t n = 0; n < image.ndim(); ++n) {
+          sizes.push_back (image.size (n));
+          strides.push_back (image.stride (n));
+        }
+        ParallelGZ::opened (temporary, sizes, strides, image.datatype().bytes());
+        if (!streamed)
+          ParallelGZ::wait (temporary);
+        ScratchFiles::remove_when_unused (temporary);
+        return image;
+      }
+      catch (...) {
+        ScratchFiles::remove (temporary);
+        throw;
+      }
+    }
+
+
+
+  //! run a per-voxel functor over the slices of a set of images using TiledLoop, as they become available in the given input images
+  /*! The slices in the range [slices.first, slices.second) are processed in
+   * chunks, each as soon as all of its slices are available in all of the
+   * input images (identified by their names) opened by open_image() as
+   * streamed; all other images are always available. The input images must
+   * share the slices of the first image traversed. */
+  template <class Functor, class... ImageTypes>
+    inline void TiledLoopAsAvailable (const vector<std::string>& inputs, std::pair<ssize_t, ssize_t> slices, ProgressBar* progress,
+                                      const Functor& functor, ImageTypes&... images)
+    {
+      for (ssize_t z = slices.first; z < slices.second;) {
+        ssize_t end = slices.second;
+        for (const auto& input : inputs)
+          end = ParallelGZ::available_slices (input, z, end);
+        TiledLoopSlices ({ z, end }, progress, functor, images...);
+        z = end;
+      }
+    }
+
+  //! as above, displaying a progress bar with the given message
+  template <class Functor, class... ImageTypes>
+    inline void TiledLoopAsAvailable (const std::string& progress_message, const vector<std::string>& inputs, std::pair<ssize_t, ssize_t> slices,
+                                      const Functor& functor, ImageTypes&... images)
+    {
+      ProgressBar progress (progress_message, std::get<0> (std::tie (images...)).size(1) * std::max<ssize_t> (0, slices.second - slices.first));
+      TiledLoopAsAvailable (inputs, slices, &progress, functor, images...);
+    }
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "perf_counters.h"
+
+#include <atomic>
+#include <cstring>
+
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+namespace MR
+{
+
+  namespace
+  {
+
+    const char* counter_names[NUM_PERF_COUNTERS] = { "cycles", "instructions", "LLC misses", "branch misses", "dTLB misses" };
+
+    // availability of each counter: -1 if not yet tried, otherwise 0 or 1
+    std::atomic<int> counter_available[NUM_PERF_COUNTERS] = { { -1 }, { -1 }, { -1 }, { -1 }, { -1 } };
+
+    int open_counter (size_t n)
+    {
+#ifdef __linux__
+      static const uint32_t types[NUM_PERF_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+      static const uint64_t configs[NUM_PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) };
+      perf_event_attr attr;
+      memset (&attr, 0, sizeof (attr));
+      attr.size = sizeof (attr);
+      attr.type = types[n];
+      attr.config = configs[n];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      // this thread only (pid 0), on any CPU (-1)
+      return syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+      return -1;
+#endif
+    }
+
+    // the counters of the calling thread, opened on first use
+    struct ThreadCounters { NOMEMALIGN
+      ThreadCounters () {
+        for (size_t n = 0; n < NUM_PERF_COUNTERS; ++n) {
+          fd[n] = open_counter (n);
+          int expected = -1;
+          if (counter_available[n].compare_exchange_strong (expected, fd[n] >= 0 ? 1 : 0) && fd[n] < 0)
+            DEBUG ("hardware performance counter \"" + std::string (counter_names[n]) + "\" unavailable: " + strerror (errno));
+        }
+      }
+      ~ThreadCounters () {
+#ifdef __linux__
+        for (size_t n = 0; n < NUM_PERF_COUNTERS; ++n)
+          if (fd[n] >= 0)
+            close (fd[n]);
+#endif
+      }
+      int fd[NUM_PERF_COUNTERS];
+    };
+
+  }
+
+
+
+  void PerfCounters::read (Values& values)
+  {
+    thread_local ThreadCounters counters;
+    for (size_t n = 0; n < NUM_PERF_COUNTERS; ++n) {
+      values[n] = 0;
+#ifdef __linux__
+      if (counters.fd[n] >= 0 && ::read (counters.fd[n], &values[n], sizeof (uint64_t)) != sizeof (uint64_t))
+        values[n] = 0;
+#endif
+    }
+  }
+
+
+
+  bool PerfCounters::available (size_t n)
+  {
+    return counter_available[n] > 0;
+  }
+
+  bool PerfCounters::any_available ()
+  {
+    for (size_t n = 0; n < NUM_PERF_COUNTERS; ++n)
+      if (available (n))
+        return true;
+    return false;
+  }
+
+  const char* PerfCounters::name (size_t n)
+  {
+    return counter_names[n];
+  }
+
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __perf_counters_h__
+#define __perf_counters_h__
+
+#include <array>
+#include <cstdint>
+
+#include "mrtrix.h"
+
+#define NUM_PERF_COUNTERS 5
+
+namespace MR
+{
+
+  //! Hardware performance counters of the calling thread, via perf_event_open (Linux only)
+  /*! The counters (CPU cycles, instructions retired, last-level cache misses,
+   * branch misses and data TLB load misses) are opened separately for each thread on first use,
+   * counting user-space events of that thread only, and are then read as
+   * needed: the events occurring between two reads are given by the
+   * difference of the values read.
+   *
+   * Counters that cannot be opened (e.g. on other platforms, in virtual
+   * machines without access to the PMU, or if access is restricted by the
+   * kernel.perf_event_paranoid setting) read as zero, and are reported as
+   * unavailable. */
+  class PerfCounters { NOMEMALIGN
+    public:
+      using Values = std::array<uint64_t, NUM_PERF_COUNTERS>;
+
+      //! read the current values of the counters of the calling thread (opening them if necessary)
+      static void read (Values& values);
+
+      //! whether counter n could be opened (by the first thread to try)
+      static bool available (size_t n);
+      //! whether any of the counters could be opened
+      static bool any_available ();
+
+      static const char* name (size_t n);
+  };
+
+}
+
+#endif
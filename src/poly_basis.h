@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __poly_basis_h__
+#define __poly_basis_h__
+
+#include "mrtrix.h"
+#include "transform.h"
+
+namespace MR
+{
+
+  // Function to get the number of basis vectors based on the desired order
+  // (for polynomials in two rather than three dimensions if planar)
+  inline int GetBasisVecs(int order, bool planar = false)
+  {
+    if (planar)
+      return (order + 1) * (order + 2) / 2;
+    int n_basis_vecs;
+      switch (order) {
+        case 0:
+          n_basis_vecs = 1;
+          break;
+        case 1:
+          n_basis_vecs = 4;
+          break;
+        case 2:
+          n_basis_vecs = 10;
+          break;
+        default:
+          n_basis_vecs = 20;
+          break;
+        }
+    return n_basis_vecs;
+  };
+
+  //PolyBasisFunction struct to get the user specified amount of basis functions
+  //(in planar mode, 2D polynomials of the in-plane position within each slice)
+  struct PolyBasisFunction { MEMALIGN (PolyBasisFunction)
+
+    PolyBasisFunction(const int order, const bool planar = false) : n_basis_vecs (GetBasisVecs(order, planar)), planar (planar) { };
+
+    const int n_basis_vecs;
+    const bool planar;
+
+    // The values of the basis functions at a position: a vector of at most 20 elements, held on the
+    // stack, so that the basis can be evaluated per voxel without allocating
+    using Basis = Eigen::Matrix<double, Eigen::Dynamic, 1, 0, 20, 1>;
+
+    // Position of voxel vox at which the basis functions are evaluated: its scanner position, or
+    // in planar mode its in-plane position (in mm) within its slice
+    FORCE_INLINE Eigen::Vector3 position (const Transform& transform, const Eigen::Vector3& vox) const {
+      if (!planar)
+        return transform.voxel2scanner * vox;
+      return Eigen::Vector3 (vox[0] * transform.voxel2scanner.linear().col(0).norm(), vox[1] * transform.voxel2scanner.linear().col(1).norm(), 0.0);
+    }
+
+    FORCE_INLINE Basis operator () (const Eigen::Vector3& pos) const {
+      double x = pos[0];
+      double y = pos[1];
+      double z = pos[2];
+      Basis basis (n_basis_vecs);
+      basis(0) = 1.0;
+      if (planar) {
+        if (n_basis_vecs < 3)
+          return basis;
+        basis(1) = x;
+        basis(2) = y;
+        if (n_basis_vecs < 6)
+          return basis;
+        basis(3) = x * x;
+        basis(4) = y * y;
+        basis(5) = x * y;
+        if (n_basis_vecs < 10)
+          return basis;
+        basis(6) = x * x * x;
+        basis(7) = y * y * y;
+        basis(8) = x * x * y;
+        basis(9) = y * y * x;
+        return basis;
+      }
+      if (n_basis_vecs < 4)
+        return basis;
+
+      basis(1) = x;
+      basis(2) = y;
+      basis(3) = z;
+      if (n_basis_vecs < 10)
+        return basis;
+
+      basis(4) = x * x;
+      basis(5) = y * y;
+      basis(6) = z * z;
+      basis(7) = x * y;
+      basis(8) = x * z;
+      basis(9) = y * z;
+      if (n_basis_vecs < 20)
+        return basis;
+
+      basis(10) = x * x * x;
+      basis(11) = y * y * y;
+      basis(12) = z * z * z;
+      basis(13) = x * x * y;
+      basis(14) = x * x * z;
+      basis(15) = y * y * x;
+      basis(16) = y * y * z;
+      basis(17) = z * z * x;
+      basis(18) = z * z * y;
+      basis(19) = x * y * z;
+    return basis;
+    }
+  };
+
+}
+
+#endif
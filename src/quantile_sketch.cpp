@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "quantile_sketch.h"
+
+#include <cstring>
+#include <iostream>
+
+namespace MR
+{
+
+  namespace {
+    constexpr int bin_shift = 23 - QuantileSketch::mantissa_bits;
+  }
+
+
+
+  void QuantileSketch::merge (const QuantileSketch& other)
+  {
+    for (const auto& bin : other.bins)
+      bins[bin.first] += bin.second;
+    total += other.total;
+  }
+
+
+
+  void QuantileSketch::write (std::ostream& stream) const
+  {
+    stream << bins.size() << "\n";
+    for (const auto& bin : bins)
+      stream << bin.first << " " << bin.second << "\n";
+  }
+
+
+
+  void QuantileSketch::read (std::istream& stream)
+  {
+    size_t num_bins;
+    if (!(stream >> num_bins))
+      throw Exception ("error reading quantile sketch");
+    for (size_t n = 0; n < num_bins; ++n) {
+      uint32_t bin_key;
+      uint64_t count;
+      if (!(stream >> bin_key >> count))
+        throw Exception ("error reading quantile sketch");
+      bins[bin_key] += count;
+      total += count;
+    }
+  }
+
+
+
+  float QuantileSketch::quantile (default_type q) const
+  {
+    if (!total)
+      throw Exception ("cannot estimate quantile of empty sketch");
+    uint64_t rank = std::round (q * total);
+    if (rank >= total)
+      rank = total - 1;
+    uint64_t cumulative = 0;
+    for (const auto& bin : bins) {
+      cumulative += bin.second;
+      if (cumulative > rank)
+        return value (bin.first);
+    }
+    return value (bins.rbegin()->first);
+  }
+
+
+
+  uint32_t QuantileSketch::key (float value)
+  {
+    uint32_t bits;
+    memcpy (&bits, &value, sizeof (bits));
+    // flip bits so that unsigned integer ordering matches floating-point ordering
+    bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+    return bits >> bin_shift;
+  }
+
+
+
+  float QuantileSketch::value (uint32_t key)
+  {
+    uint32_t bits = (key << bin_shift) | (uint32_t(1) << (bin_shift - 1));
+    bits = (bits & 0x80000000u) ? (bits & 0x7FFFFFFFu) : ~bits;
+    float value;
+    memcpy (&value, &bits, sizeof (value));
+    return value;
+  }
+
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __quantile_sketch_h__
+#define __quantile_sketch_h__
+
+#include <map>
+
+#include "mrtrix.h"
+
+namespace MR
+{
+
+  //! A mergeable sketch of the distribution of a set of floating-point values
+  /*! This allows quantiles to be estimated for data that are processed in
+   * parts (e.g. in slabs, or by separate processes), without holding all
+   * values in memory: sketches of each part can be merged to provide the
+   * sketch of the whole.
+   *
+   * Values are binned according to the leading bits of their IEEE 754
+   * representation, so that the relative precision of each bin is fixed
+   * (2^-mantissa_bits) irrespective of the range of the data. The number of
+   * bins is therefore bounded by the dynamic range of the data, not by the
+   * number of values inserted. Non-finite values are ignored. */
+  class QuantileSketch { NOMEMALIGN
+    public:
+      QuantileSketch () : total (0) { }
+
+      void insert (float value) {
+        if (std::isfinite (value)) {
+          ++bins[key (value)];
+          ++total;
+        }
+      }
+
+      void merge (const QuantileSketch& other);
+
+      //! write the sketch in text form, suitable for merging by read()
+      void write (std::ostream& stream) const;
+      //! merge a sketch previously written by write()
+      void read (std::istream& stream);
+
+      //! estimate the quantile \a q (in the range [0,1])
+      /*! This returns the centre of the bin holding the element of rank
+       * round (q * size()), consistent with selecting that element from the
+       * sorted list of values. */
+      float quantile (default_type q) const;
+
+      uint64_t size () const { return total; }
+      bool empty () const { return !total; }
+      void clear () { bins.clear(); total = 0; }
+
+      static constexpr int mantissa_bits = 12;
+
+    protected:
+      std::map<uint32_t, uint64_t> bins;
+      uint64_t total;
+
+      //! map a value onto its bin, preserving ordering
+      static uint32_t key (float value);
+      //! the value at the centre of a bin
+      static float value (uint32_t key);
+  };
+
+}
+
+#endif
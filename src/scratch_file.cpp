@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "scratch_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "file/config.h"
+#include "file/path.h"
+
+#ifndef MRTRIX_WINDOWS
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/statvfs.h>
+# include <unistd.h>
+#endif
+
+namespace MR
+{
+
+  namespace
+  {
+    std::string scratch_directory;
+    size_t num_files = 0;
+
+    // files to be removed on exit, or on a signal (before invoking the previous handler of the signal)
+    vector<std::string> files_to_remove;
+    void (*previous_handlers[2]) (int) = { SIG_DFL, SIG_DFL };
+    const int signals[2] = { SIGINT, SIGTERM };
+
+    void remove_files ()
+    {
+      for (const auto& file : files_to_remove)
+        std::remove (file.c_str());
+    }
+
+    void remove_files_on_signal (int signal)
+    {
+      remove_files();
+      for (size_t n = 0; n < 2; ++n) {
+        if (signal == signals[n]) {
+          if (previous_handlers[n] != SIG_DFL && previous_handlers[n] != SIG_IGN) {
+            previous_handlers[n] (signal);
+            return;
+          }
+          std::signal (signal, SIG_DFL);
+          std::raise (signal);
+        }
+      }
+    }
+  }
+
+
+
+  void ScratchFiles::set_directory (const std::string& path)
+  {
+    if (path.size() && !Path::is_dir (path))
+      throw Exception ("scratch directory \"" + path + "\" does not exist");
+    scratch_directory = path;
+  }
+
+  const std::string& ScratchFiles::directory ()
+  {
+    return scratch_directory;
+  }
+
+
+
+  const std::string& ScratchFiles::memory_directory ()
+  {
+    static const std::string shm =
+#ifdef __linux__
+      Path::is_dir ("/dev/shm") ? "/dev/shm" :
+#endif
+      "";
+    static const std::string none;
+    return scratch_directory.empty() ? shm : none;
+  }
+
+  size_t ScratchFiles::memory_available ()
+  {
+#ifndef MRTRIX_WINDOWS
+    struct statvfs info;
+    if (memory_directory().size() && !statvfs (memory_directory().c_str(), &info))
+      return size_t (info.f_bavail) * info.f_frsize;
+#endif
+    return 0;
+  }
+
+  bool ScratchFiles::in_memory (const std::string& path)
+  {
+    return memory_directory().size() && Path::dirname (path) == memory_directory();
+  }
+
+
+
+  std::string ScratchFiles::path (const std::string& suffix, bool in_memory)
+  {
+#ifdef MRTRIX_WINDOWS
+    const int pid = 0;
+#else
+    const int pid = getpid();
+#endif
+    const std::string dir = scratch_directory.size() ? scratch_directory :
+                            ( in_memory && memory_directory().size() ? memory_directory() : File::Config::get ("TmpFileDir", "/tmp") );
+    return Path::join (dir, "mrtrix-scratch-" + str(pid) + "-" + str(num_files++) + suffix);
+  }
+
+
+
+  bool ScratchFiles::reserve (const std::string& path, size_t bytes)
+  {
+#ifdef __linux__
+    const int fd = open (path.c_str(), O_RDWR);
+    if (fd < 0)
+      throw Exception ("error opening temporary file \"" + path + "\": " + strerror (errno));
+    struct stat info;
+    int error = fstat (fd, &info) ? errno : 0;
+    if (!error) {
+      if (!bytes)
+        bytes = info.st_size;
+      error = posix_fallocate (fd, 0, bytes);
+    }
+    close (fd);
+    if (error == ENOSPC)
+      throw Exception ("insufficient space in directory \"" + Path::dirname (path) + "\" for temporary file of " + str(bytes >> 20) + " MB");
+    if (error) {
+      DEBUG ("unable to allocate space of temporary file \"" + path + "\": " + strerror (error));
+      return false;
+    }
+    return true;
+#else
+    (void) path; (void) bytes;
+    return false;
+#endif
+  }
+
+
+
+  void ScratchFiles::remove_on_exit (const std::string& path)
+  {
+    if (files_to_remove.empty()) {
+      std::atexit (remove_files);
+      for (size_t n = 0; n < 2; ++n)
+        previous_handlers[n] = std::signal (signals[n], remove_files_on_signal);
+    }
+    files_to_remove.push_back (path);
+  }
+
+  void ScratchFiles::remove (const std::string& path)
+  {
+    std::remove (path.c_str());
+    auto file = std::find (files_to_remove.begin(), files_to_remove.end(), path);
+    if (file != files_to_remove.end())
+      files_to_remove.erase (file);
+  }
+
+  void ScratchFiles::remove_when_unused (const std::string& path)
+  {
+#ifndef MRTRIX_WINDOWS
+    // the file remains in use through its mapping until the image is released
+    remove (path);
+#else
+    // (a file cannot be removed while it is mapped)
+    remove_on_exit (path);
+#endif
+  }
+
+
+
+  void ScratchFiles::created (const std::string& path, void* address, size_t bytes, ScratchAccess access)
+  {
+#ifndef MRTRIX_WINDOWS
+    // allocate the space of the (sparse) file now, to fail early if the filesystem is full
+    try {
+      reserve (path);
+    }
+    catch (...) {
+      std::remove (path.c_str());
+      throw;
+    }
+    if (address && access != ScratchAccess::Normal) {
+      const size_t page = sysconf (_SC_PAGESIZE);
+      const size_t start = reinterpret_cast<size_t> (address);
+      const size_t first = (start + page - 1) / page * page, last = (start + bytes) / page * page;
+      if (last > first)
+        posix_madvise (reinterpret_cast<void*> (first), last - first,
+                       access == ScratchAccess::Sequential ? POSIX_MADV_SEQUENTIAL : POSIX_MADV_RANDOM);
+    }
+#else
+    (void) address; (void) bytes; (void) access;
+#endif
+    remove_when_unused (path);
+  }
+
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __scratch_file_h__
+#define __scratch_file_h__
+
+#include "image.h"
+#include "tiled_loop.h"
+
+namespace MR
+{
+
+  //! the expected pattern of access to a scratch image, passed on to the system for file-backed images
+  enum class ScratchAccess { Normal, Sequential, Random };
+
+  //! Scratch images backed by memory-mapped temporary files
+  /*! By default, scratch images are held in memory. If a scratch directory
+   * is set (e.g. on fast local storage, for systems with little memory),
+   * each scratch image is instead created as a temporary image file in that
+   * directory, memory-mapped, so that the system keeps in memory only those
+   * pages in use, and writes the others back to the file as needed.
+   *
+   * The space of each file is allocated when it is created (where the
+   * filesystem supports it), so that running out of space fails at that
+   * point rather than when the pages are written back; the expected access
+   * pattern is passed on to the system (posix_madvise()), to set the extent
+   * of read-ahead. On POSIX systems, each file is removed from the directory
+   * as soon as it is mapped, and its space released once it is unmapped, so
+   * that no file is left behind whichever way the command exits (including
+   * on a signal); elsewhere, the files are removed on exit.
+   *
+   * Other temporary image files (such as the uncompressed copies of
+   * compressed images, see ParallelGZ) are also created here if a scratch
+   * directory is set; otherwise those held in memory are created in a
+   * memory-backed filesystem (see memory_directory()), and the others in the
+   * directory set by the TmpFileDir config entry. They are removed in the
+   * same way. */
+  class ScratchFiles { NOMEMALIGN
+    public:
+      //! set the directory of the scratch files (an empty path for scratch images held in memory)
+      static void set_directory (const std::string& path);
+      static const std::string& directory ();
+
+      //! the directory of temporary files held in memory: that of a memory-backed filesystem (/dev/shm) on
+      //! Linux, if present and no scratch directory is set; otherwise empty
+      static const std::string& memory_directory ();
+      //! the space available in the memory directory (zero if there is none)
+      static size_t memory_available ();
+      //! whether a temporary file is in the memory directory
+      static bool in_memory (const std::string& path);
+
+      //! a new, unique file name with the given suffix in the scratch directory (or, if not set,
+      //! in the memory directory if requested and available, or otherwise in that of temporary files)
+      static std::string path (const std::string& suffix = ".mif", bool in_memory = false);
+
+      //! allocate the space of a file up to the given size (by default, its current size), extending
+      //! it if necessary; returns false if this is not supported (on platforms other than Linux)
+      /*! This throws if there is insufficient space, so that running out of
+       * space fails at this point rather than when the pages of a mapping of
+       * the file are written (temporary files in the memory directory may
+       * then be created in the directory of temporary files instead). */
+      static bool reserve (const std::string& path, size_t bytes = 0);
+
+      //! allocate the space of a newly created scratch file, set the access pattern of its buffer
+      //! (if directly accessible, i.e. non-null), and arrange for its removal
+      static void created (const std::string& path, void* address, size_t bytes, ScratchAccess access);
+
+      //! remove a temporary file once no longer in use, i.e. now on POSIX systems if it is memory-mapped, and otherwise on exit
+      static void remove_when_unused (const std::string& path);
+      //! remove a temporary file on exit, or on SIGINT or SIGTERM, unless removed earlier by remove()
+      static void remove_on_exit (const std::string& path);
+      static void remove (const std::string& path);
+  };
+
+
+
+  //! a new scratch image, zero-filled, in memory or backed by a file in the scratch directory (see ScratchFiles)
+  /*! Images held in memory are placed by first_touch(). */
+  template <class ValueType>
+    inline Image<ValueType> scratch_image (const Header& header, const std::string& description, ScratchAccess access = ScratchAccess::Normal)
+    {
+      if (ScratchFiles::directory().empty()) {
+        auto image = Image<ValueType>::scratch (header, description);
+        first_touch (image, "scratch " + description);
+        return image;
+      }
+      Header file_header (header);
+      file_header.datatype() = DataType::from<ValueType>();
+      file_header.keyval().clear();
+      const std::string path = ScratchFiles::path();
+      auto image = Image<ValueType>::create (path, file_header);
+      const size_t bytes = image_buffer_bytes (image);
+      ScratchFiles::created (path, bytes ? image.address() : nullptr, bytes, access);
+      DEBUG ("scratch image \"" + description + "\" backed by file \"" + path + "\"");
+      return image;
+    }
+
+}
+
+#endif
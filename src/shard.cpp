@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "shard.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <unistd.h>
+
+#include "file/config.h"
+#include "file/ofstream.h"
+#include "file/path.h"
+#include "file/utils.h"
+
+namespace MR
+{
+
+  //CONF option: ShardTimeout
+  //CONF default: 3600
+  //CONF The maximum time (in seconds) that a process running as one of several
+  //CONF shards will wait for the partial results of the other shards, before
+  //CONF concluding that one of them has failed.
+
+
+
+  Shard::Shard (const std::string& directory, size_t index, size_t count) :
+    directory (directory),
+    index_ (index),
+    count_ (count),
+    step (0)
+  {
+    if (!count_)
+      throw Exception ("number of shards must be positive");
+    if (index_ >= count_)
+      throw Exception ("shard index (" + str(index_) + ") must be less than the number of shards (" + str(count_) + ")");
+    if (!Path::is_dir (directory))
+      throw Exception ("shard directory \"" + directory + "\" does not exist");
+    if (Path::exists (filename (0, index_)))
+      throw Exception ("stale partial results found in shard directory \"" + directory + "\" (a fresh directory is required for each run)");
+  }
+
+
+
+  vector<std::string> Shard::exchange (const std::string& partial)
+  {
+    if (!active())
+      return { partial };
+
+    // write to a temporary file, then rename it, so that other shards never read a partially written file
+    const std::string name = filename (step, index_);
+    const std::string temp_name = name + ".tmp" + str(getpid());
+    {
+      File::OFStream out (temp_name, std::ios::out | std::ios::binary);
+      out << partial;
+    }
+    if (std::rename (temp_name.c_str(), name.c_str()))
+      throw Exception ("error renaming partial result file \"" + temp_name + "\": " + strerror (errno));
+
+    const auto timeout = std::chrono::seconds (File::Config::get_int ("ShardTimeout", 3600));
+    const auto start = std::chrono::steady_clock::now();
+    auto delay = std::chrono::milliseconds (10);
+
+    vector<std::string> partials (count_);
+    for (size_t n = 0; n < count_; ++n) {
+      while (!Path::exists (filename (step, n))) {
+        if (std::chrono::steady_clock::now() - start > timeout)
+          throw Exception ("timed out waiting for partial results of shard " + str(n) + " in directory \"" + directory + "\"");
+        std::this_thread::sleep_for (delay);
+        delay = std::min (2*delay, std::chrono::milliseconds (1000));
+      }
+      std::ifstream in (filename (step, n), std::ios::in | std::ios::binary);
+      partials[n].assign (std::istreambuf_iterator<char> (in), std::istreambuf_iterator<char>());
+      if (!in)
+        throw Exception ("error reading partial result file \"" + filename (step, n) + "\"");
+    }
+
+    // All shards have now completed the previous step, so its file is no longer needed
+    if (step)
+      File::unlink (filename (step-1, index_));
+    ++step;
+
+    return partials;
+  }
+
+
+
+  void Shard::finish ()
+  {
+    // The files of this final step are left in place: a shard can never know whether all
+    // others have seen them, and they only serve as markers that the run is complete
+    exchange (std::string());
+  }
+
+
+
+  std::string Shard::path (const std::string& name) const
+  {
+    return Path::join (directory, name);
+  }
+
+
+
+  std::string Shard::filename (size_t step, size_t shard) const
+  {
+    return path ("step-" + str(step) + "-shard-" + str(shard) + ".txt");
+  }
+
+}
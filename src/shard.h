@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __shard_h__
+#define __shard_h__
+
+#include "mrtrix.h"
+
+namespace MR
+{
+
+  //! Exchange partial results of a computation distributed over several processes
+  /*! Each process (shard) handles a subset of the data, and exchanges its
+   * partial results with all other shards through small files in a directory
+   * on a shared filesystem, without the need for any other service.
+   *
+   * Every shard reads the partial results of all shards (including its own)
+   * in the same order, so that any reduction performed on these yields
+   * identical results in every process: there is therefore no need for a
+   * coordinating process to broadcast the reduced results. This requires all
+   * shards to call exchange() the same number of times, in the same order.
+   *
+   * A default-constructed Shard represents a single process handling all of
+   * the data, for which exchange() simply returns its input. */
+  class Shard { NOMEMALIGN
+    public:
+      Shard () : index_ (0), count_ (1), step (0) { }
+      Shard (const std::string& directory, size_t index, size_t count);
+
+      size_t index () const { return index_; }
+      size_t count () const { return count_; }
+      bool active () const { return count_ > 1; }
+
+      //! the range [first, second) of an axis of the given size handled by a shard (by default, this one)
+      std::pair<ssize_t, ssize_t> range (ssize_t size) const { return range (size, index_); }
+      std::pair<ssize_t, ssize_t> range (ssize_t size, size_t shard) const {
+        return { ssize_t (shard * size / count_), ssize_t ((shard+1) * size / count_) };
+      }
+
+      //! write this shard's partial result, then wait for and return those of all shards, in shard order
+      vector<std::string> exchange (const std::string& partial);
+
+      //! a final exchange, signalling that this shard will make no further use of the shared directory
+      void finish ();
+
+      //! path of a file in the shared directory
+      std::string path (const std::string& name) const;
+
+    protected:
+      std::string directory;
+      size_t index_, count_, step;
+
+      std::string filename (size_t step, size_t shard) const;
+  };
+
+}
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "thread_pool.h"
+
+#include "thread.h"
+#include "timings.h"
+#include "trace.h"
+#include "file/config.h"
+
+#ifdef __linux__
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+#define THREAD_POOL_SPIN_COUNT 20000
+
+namespace MR
+{
+
+  //CONF option: ThreadAffinity
+  //CONF default: 0 (false)
+  //CONF Whether to pin each thread of the parallel loops of the
+  //CONF mtnormalise and icls commands to its own core (Linux only), so
+  //CONF that the pages of the images they process are placed on the NUMA
+  //CONF node of the thread that processes them.
+
+  namespace
+  {
+    // set while the current thread is running a job of a pool
+    thread_local bool in_job = false;
+
+    // -1 until set by ThreadPool::pin_threads(), in which case the config entry is used
+    int pin_shared = -1;
+    bool shared_started = false;
+  }
+
+
+
+  ThreadPool::ThreadPool (size_t num_threads, bool pin_to_cores) :
+    job (nullptr),
+    generation (0),
+    remaining (0),
+    stop (false)
+  {
+#ifdef __linux__
+    // the cores are those the process is allowed to run on, read before any thread is pinned
+    if (pin_to_cores && num_threads > 1) {
+      cpu_set_t allowed;
+      CPU_ZERO (&allowed);
+      if (!sched_getaffinity (0, sizeof (allowed), &allowed)) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+          if (CPU_ISSET (cpu, &allowed))
+            cores.push_back (cpu);
+      }
+      if (cores.empty())
+        WARN ("unable to determine the cores available to the process - threads will not be pinned");
+      else if (cores.size() < num_threads)
+        WARN ("more threads (" + str(num_threads) + ") than available cores (" + str(cores.size()) + ") - several threads will share each core");
+    }
+#else
+    if (pin_to_cores)
+      WARN ("pinning threads to cores is only supported on Linux - threads will not be pinned");
+#endif
+    for (size_t n = 1; n < num_threads; ++n)
+      workers.push_back (std::thread (&ThreadPool::worker, this, n));
+    pin (0);
+    if (pinned())
+      INFO ("pinned " + str(num_threads) + " threads to cores");
+  }
+
+
+
+  ThreadPool::~ThreadPool ()
+  {
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      stop = true;
+      ++generation;
+    }
+    job_ready.notify_all();
+    for (auto& w : workers)
+      w.join();
+  }
+
+
+
+  void ThreadPool::run (const std::function<void(size_t)>& job_to_run)
+  {
+    if (workers.empty() || in_job) {
+      job_to_run (0);
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      job = &job_to_run;
+      job_name = Trace::enabled() ? Trace::current() : std::string();
+      if (Trace::enabled() && job_name.empty())
+        job_name = "parallel job";
+      job_phase = Timings::counting() ? Timings::current() : std::string();
+      exception = nullptr;
+      remaining = workers.size();
+      ++generation;
+    }
+    job_ready.notify_all();
+
+    execute (0);
+
+    // barrier: spin briefly before blocking until all workers have completed the job
+    for (size_t n = 0; remaining && n < THREAD_POOL_SPIN_COUNT; ++n)
+      std::this_thread::yield();
+    if (remaining) {
+      std::unique_lock<std::mutex> lock (mutex);
+      job_done.wait (lock, [this] { return !remaining; });
+    }
+
+    job = nullptr;
+    if (exception)
+      std::rethrow_exception (exception);
+  }
+
+
+
+  void ThreadPool::pin (size_t index)
+  {
+#ifdef __linux__
+    if (cores.empty())
+      return;
+    cpu_set_t core;
+    CPU_ZERO (&core);
+    CPU_SET (cores[index % cores.size()], &core);
+    if (pthread_setaffinity_np (pthread_self(), sizeof (core), &core))
+      WARN ("unable to pin thread " + str(index) + " to core " + str(cores[index % cores.size()]));
+#endif
+  }
+
+
+
+  void ThreadPool::worker (size_t index)
+  {
+    pin (index);
+    size_t last_generation = 0;
+    while (true) {
+      // wait for the next job: spin briefly, then block
+      for (size_t n = 0; generation == last_generation && n < THREAD_POOL_SPIN_COUNT; ++n)
+        std::this_thread::yield();
+      {
+        std::unique_lock<std::mutex> lock (mutex);
+        job_ready.wait (lock, [&] { return generation != last_generation; });
+        last_generation = generation;
+        if (stop)
+          return;
+      }
+
+      execute (index);
+
+      if (!--remaining) {
+        std::lock_guard<std::mutex> lock (mutex);
+        job_done.notify_one();
+      }
+    }
+  }
+
+
+
+  void ThreadPool::execute (size_t index)
+  {
+    in_job = true;
+    try {
+      Trace::Span span (job_name);
+      // the counters of the calling thread are already attributed to its current phase
+      Timings::Job counters (index ? job_phase : std::string(), index);
+      (*job) (index);
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> lock (mutex);
+      if (!exception)
+        exception = std::current_exception();
+    }
+    in_job = false;
+  }
+
+
+
+  ThreadPool& ThreadPool::shared ()
+  {
+    static ThreadPool pool (std::max<size_t> (1, Thread::number_of_threads()),
+                            pin_shared < 0 ? File::Config::get_bool ("ThreadAffinity", false) : pin_shared);
+    shared_started = true;
+    return pool;
+  }
+
+
+
+  void ThreadPool::pin_threads (bool pin)
+  {
+    if (shared_started && pin != shared().pinned())
+      WARN ("the shared thread pool has already been started - its thread affinity cannot be changed");
+    pin_shared = pin;
+  }
+
+}
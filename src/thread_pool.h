@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __thread_pool_h__
+#define __thread_pool_h__
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <thread>
+
+#include "mrtrix.h"
+
+namespace MR
+{
+
+  //! A pool of worker threads, started once and reused for every parallel loop
+  /*! Unlike Thread::run(), which starts and joins a new set of threads for
+   * each invocation, the threads of the pool persist for the lifetime of the
+   * pool, and wait for the next job between invocations: they first spin
+   * briefly, so that a job issued shortly after the previous one (as in the
+   * successive loops of an iterative fit) is picked up with minimal latency,
+   * and only then block.
+   *
+   * A job is run concurrently by the calling thread and all worker threads,
+   * and run() returns once all of them have completed it (or rethrows the
+   * first exception thrown by any of them). A job issued from within a job
+   * is run by the calling thread only.
+   *
+   * If tracing is enabled, the execution of each job by each thread is
+   * recorded as a span named after the innermost span of the calling thread;
+   * similarly, if hardware performance counters are being recorded (see
+   * Timings), the events of each worker thread are attributed to the current
+   * phase of the calling thread.
+   *
+   * The threads of the pool can be pinned each to its own core (taken in
+   * turn from the cores the process is allowed to run on), so that a thread
+   * keeps the same core, and hence the same NUMA node, for the lifetime of
+   * the pool: this is what allows TiledLoop to place the pages of the images
+   * on the node of the thread that processes them (see first_touch()). */
+  class ThreadPool { NOMEMALIGN
+    public:
+      //! a pool of the given total number of threads (including the calling thread), optionally pinned to cores
+      ThreadPool (size_t num_threads, bool pin = false);
+      ~ThreadPool ();
+
+      //! the total number of threads, including the calling thread
+      size_t size () const { return workers.size() + 1; }
+
+      //! run job (thread) for each thread in [0, size()), with thread 0 being the calling thread
+      void run (const std::function<void(size_t)>& job);
+
+      //! run the execute() method of a separate copy of the functor in each thread
+      template <class Functor>
+        void run_multi (const Functor& functor) {
+          run ([&functor] (size_t) { Functor copy (functor); copy.execute(); });
+        }
+
+      //! the pool shared by all parallel loops of a command, started on first use
+      //! (with the number of threads set by the -nthreads option or the NumberOfThreads config entry)
+      static ThreadPool& shared ();
+
+      //! whether the threads of the shared pool are pinned to cores: this must be set before its first use
+      //! (the default is set by the ThreadAffinity config entry)
+      static void pin_threads (bool pin);
+
+      //! whether the threads of this pool are pinned to cores
+      bool pinned () const { return cores.size(); }
+
+    protected:
+      vector<std::thread> workers;
+      std::mutex mutex;
+      std::condition_variable job_ready, job_done;
+      const std::function<void(size_t)>* job;
+      std::string job_name, job_phase;
+      std::atomic<size_t> generation, remaining;
+      std::exception_ptr exception;
+      vector<int> cores;
+      bool stop;
+
+      void worker (size_t index);
+      void pin (size_t index);
+      void execute (size_t index);
+  };
+
+}
+
+#endif
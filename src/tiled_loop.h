@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __tiled_loop_h__
+#define __tiled_loop_h__
+
+#include <memory>
+#include <tuple>
+
+#ifdef __linux__
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
+#include "apply.h"
+#include "huge_pages.h"
+#include "image_helpers.h"
+#include "progressbar.h"
+#include "algo/loop.h"
+#include "thread_pool.h"
+#include "file/config.h"
+
+namespace MR
+{
+
+  //CONF option: TileCacheSize
+  //CONF default: 262144
+  //CONF The approximate size (in bytes) of the tiles in which images are
+  //CONF traversed by TiledLoop: this should be set to (at most) the size of
+  //CONF the per-core L2 cache.
+
+  //! The tiles in which TiledLoop traverses the first three axes of a set of images
+  /*! Each tile consists of whole rows along the x axis (contiguous in memory,
+   * or nearly so, for most image layouts), stacked along y and then z until
+   * the data of all images traversed (bytes_per_voxel, for all volumes) fill
+   * the cache. Either all slices are covered, or the range of slices
+   * [z_begin, z_begin + nz) only. */
+  class Tiling { NOMEMALIGN
+    public:
+      template <class HeaderType>
+        Tiling (const HeaderType& header, size_t bytes_per_voxel, size_t cache_bytes = default_cache_bytes()) :
+          Tiling (header, bytes_per_voxel, { 0, header.size(2) }, cache_bytes) { }
+
+      template <class HeaderType>
+        Tiling (const HeaderType& header, size_t bytes_per_voxel, std::pair<ssize_t, ssize_t> slice_range, size_t cache_bytes = default_cache_bytes()) :
+          nx (header.size(0)), ny (header.size(1)), nz (std::max<ssize_t> (0, slice_range.second - slice_range.first)), z_begin (slice_range.first),
+          rows (std::max<ssize_t> (1, std::min<ssize_t> (ny, cache_bytes / (nx * bytes_per_voxel)))),
+          slices (rows < ny ? 1 : std::max<ssize_t> (1, std::min<ssize_t> (nz, cache_bytes / (nx * ny * bytes_per_voxel)))) { }
+
+      size_t size () const { return tiles_y() * ((nz + slices - 1) / slices); }
+      ssize_t tiles_y () const { return (ny + rows - 1) / rows; }
+
+      static size_t default_cache_bytes () {
+        static const size_t bytes = File::Config::get_int ("TileCacheSize", 262144);
+        return bytes;
+      }
+
+      const ssize_t nx, ny, nz, z_begin, rows, slices;
+  };
+
+
+
+  //! The order in which the threads of the pool take the tiles of a Tiling
+  /*! The tiles are divided into contiguous blocks, one per thread: each
+   * thread first takes the tiles of its own block in turn, and then (once
+   * its block is exhausted) those remaining in the blocks of the other
+   * threads. Each thread thus processes much the same part of the images
+   * (the same fraction of the slices) in every loop, while the load remains
+   * balanced between threads. */
+  class TileQueue { NOMEMALIGN
+    public:
+      TileQueue (size_t num_tiles, size_t num_blocks) :
+          num_tiles (num_tiles), num_blocks (num_blocks), next (new std::atomic<size_t> [num_blocks]) {
+        for (size_t b = 0; b < num_blocks; ++b)
+          next[b] = begin (b);
+      }
+
+      //! the next tile to be processed by the given thread, or size() once all tiles have been taken
+      size_t take (size_t thread) {
+        for (size_t n = 0; n < num_blocks; ++n) {
+          const size_t b = (thread + n) % num_blocks;
+          if (next[b] < begin (b+1)) {
+            const size_t t = next[b]++;
+            if (t < begin (b+1))
+              return t;
+          }
+        }
+        return num_tiles;
+      }
+
+      size_t size () const { return num_tiles; }
+
+    protected:
+      const size_t num_tiles, num_blocks;
+      std::unique_ptr<std::atomic<size_t>[]> next;
+
+      size_t begin (size_t block) const { return block * num_tiles / num_blocks; }
+  };
+
+
+
+  //! the number of bytes per voxel (i.e. over all volumes) of a set of images
+  inline size_t bytes_per_voxel () { return 0; }
+
+  template <class ImageType, class... ImageTypes>
+    inline size_t bytes_per_voxel (const ImageType& image, const ImageTypes&... images)
+    {
+      size_t volumes = 1;
+      for (size_t n = 3; n < image.ndim(); ++n)
+        volumes *= image.size(n);
+      return volumes * sizeof (typename ImageType::value_type) + bytes_per_voxel (images...);
+    }
+
+
+
+  namespace
+  {
+
+    struct SetIndex { NOMEMALIGN
+      SetIndex (size_t axis, ssize_t value) : axis (axis), value (value) { }
+      template <class ImageType>
+        FORCE_INLINE void operator() (ImageType& image) const { image.index (axis) = value; }
+      const size_t axis;
+      const ssize_t value;
+    };
+
+    template <class Functor, class... ImageTypes>
+      struct TiledLoopThread { MEMALIGN (TiledLoopThread)
+        TiledLoopThread (const Tiling& tiling, TileQueue& queue, std::atomic<size_t>& completed,
+                         ProgressBar* progress, size_t& shown, const Functor& functor, const ImageTypes&... images) :
+          tiling (tiling), queue (queue), completed (completed), progress (progress), shown (shown),
+          caller (std::this_thread::get_id()), functor (functor), images (images...) { }
+
+        void execute (size_t thread) {
+          size_t t;
+          while ((t = queue.take (thread)) < tiling.size()) {
+            const ssize_t y0 = (t % tiling.tiles_y()) * tiling.rows, z0 = tiling.z_begin + (t / tiling.tiles_y()) * tiling.slices;
+            const ssize_t y1 = std::min (y0 + tiling.rows, tiling.ny), z1 = std::min (z0 + tiling.slices, tiling.z_begin + tiling.nz);
+            for (ssize_t z = z0; z < z1; ++z) {
+              apply (SetIndex (2, z), images);
+              for (ssize_t y = y0; y < y1; ++y) {
+                apply (SetIndex (1, y), images);
+                for (ssize_t x = 0; x < tiling.nx; ++x) {
+                  apply (SetIndex (0, x), images);
+                  unpack (functor, images);
+                }
+              }
+            }
+            // (progress is counted in rows, so that it is independent of the tiling)
+            completed += (y1 - y0) * (z1 - z0);
+            // (the progress bar is only ever updated from the calling thread)
+            if (progress && std::this_thread::get_id() == caller) {
+              for (; shown < completed; ++shown)
+                ++(*progress);
+            }
+          }
+        }
+
+        const Tiling& tiling;
+        TileQueue& queue;
+        std::atomic<size_t>& completed;
+        ProgressBar* progress;
+        size_t& shown;
+        const std::thread::id caller;
+        Functor functor;
+        std::tuple<ImageTypes...> images;
+      };
+
+    template <class Functor, class... ImageTypes>
+      inline void run_tiled_loop (ProgressBar* progress, const Tiling& tiling, const Functor& functor, ImageTypes&... images)
+      {
+        if (!tiling.size())
+          return;
+        ThreadPool& pool (ThreadPool::shared());
+        TileQueue queue (tiling.size(), pool.size());
+        std::atomic<size_t> completed (0);
+        size_t shown = 0;
+        const TiledLoopThread<Functor, ImageTypes...> prototype (tiling, queue, completed, progress, shown, functor, images...);
+        pool.run ([&prototype] (size_t thread) { TiledLoopThread<Functor, ImageTypes...> copy (prototype); copy.execute (thread); });
+        if (progress) {
+          for (; shown < size_t (tiling.ny * tiling.nz); ++shown)
+            ++(*progress);
+        }
+      }
+
+  }
+
+
+
+  //! run a per-voxel functor over the first three axes of a set of images, in tiles, using the shared thread pool
+  /*! As with ThreadedLoop, each thread runs its own copy of the functor (and
+   * of the images), invoked as functor (images...) with the images positioned
+   * at each voxel in turn; the tiles are taken by the threads as they become
+   * available, in the order of a TileQueue. The tiling is determined by the
+   * first image. */
+  template <class Functor, class... ImageTypes>
+    inline void TiledLoop (const Functor& functor, ImageTypes&... images)
+    {
+      run_tiled_loop (nullptr, Tiling (std::get<0> (std::tie (images...)), bytes_per_voxel (images...)), functor, images...);
+    }
+
+  //! as above, displaying a progress bar with the given message
+  template <class Functor, class... ImageTypes>
+    inline void TiledLoop (const std::string& progress_message, const Functor& functor, ImageTypes&... images)
+    {
+      const Tiling tiling (std::get<0> (std::tie (images...)), bytes_per_voxel (images...));
+      ProgressBar progress (progress_message, tiling.ny * tiling.nz);
+      run_tiled_loop (&progress, tiling, functor, images...);
+    }
+
+  //! as above, over the range of slices [slices.first, slices.second) only
+  /*! The progress bar (if any) is incremented once for each row (along x)
+   * processed, i.e. size(1) times per slice. */
+  template <class Functor, class... ImageTypes>
+    inline void TiledLoopSlices (std::pair<ssize_t, ssize_t> slices, ProgressBar* progress, const Functor& functor, ImageTypes&... images)
+    {
+      run_tiled_loop (progress, Tiling (std::get<0> (std::tie (images...)), bytes_per_voxel (images...), slices), functor, images...);
+    }
+
+
+
+  //! copy the values of one image to another over the first three axes, using TiledLoop
+  template <class InputImageType, class OutputImageType>
+    inline void tiled_copy (InputImageType& source, OutputImageType& destination)
+    {
+      struct Copy { NOMEMALIGN
+        FORCE_INLINE void operator() (InputImageType& in, OutputImageType& out) const { out.value() = in.value(); }
+      };
+      TiledLoop (Copy(), source, destination);
+    }
+
+
+
+  namespace
+  {
+    struct Zero { NOMEMALIGN
+      template <class ImageType>
+        FORCE_INLINE void operator() (ImageType& image) const {
+          if (image.ndim() > 3) {
+            for (auto l = Loop (3, image.ndim()) (image); l; ++l)
+              image.value() = 0;
+          }
+          else
+            image.value() = 0;
+        }
+    };
+  }
+
+  //! place the pages of a newly allocated, zero-filled image held in memory on the NUMA nodes of the threads that process them
+  /*! The buffer of a scratch image (or of an image held in memory while it
+   * is written, as for compressed images) is zero-filled by the thread that
+   * allocates it, so that the system places all of its pages on the NUMA
+   * node of that thread, as normal pages. Instead, its whole pages are
+   * released, and touched again by a TiledLoop writing zeroes, so that each
+   * page is placed on the node of the thread that processes that part of the
+   * image in subsequent TiledLoops (see TileQueue), and is allocated as a
+   * huge page if these are requested (see HugePages). Since the placement is
+   * only reliable if the threads are pinned to cores (see
+   * ThreadPool::pin_threads()), nothing is done unless they are, or huge
+   * pages are requested (nor on platforms other than Linux, nor for images
+   * not directly accessible in memory, such as bitwise masks).
+   *
+   * This must not be used on images whose contents are not all zero, nor on
+   * memory-mapped image files (whose pages are placed by the system when
+   * first written, by whichever thread writes them). */
+  template <class ImageType>
+    inline void first_touch (ImageType& image, const std::string& description)
+    {
+      if (!ThreadPool::shared().pinned() && !HugePages::requested())
+        return;
+#ifdef __linux__
+      const size_t bytes = image_buffer_bytes (image);
+      if (!bytes)
+        return;
+      if (HugePages::requested())
+        HugePages::advise (image.address(), bytes, description);
+      const size_t page = sysconf (_SC_PAGESIZE);
+      const size_t start = reinterpret_cast<size_t> (image.address());
+      const size_t first = (start + page - 1) / page * page, last = (start + bytes) / page * page;
+      if (last > first && !madvise (reinterpret_cast<void*> (first), last - first, MADV_DONTNEED))
+        TiledLoop (Zero(), image);
+#endif
+    }
+
+}
+
+#endif
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "timings.h"
+
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <sys/resource.h>
+
+#include "alloc_stats.h"
+#include "file/ofstream.h"
+
+namespace MR
+{
+
+  namespace
+  {
+
+    // the hardware performance counters, followed by the number of allocations and of bytes allocated
+    using Counters = Timings::Counters;
+    const size_t allocations = NUM_PERF_COUNTERS, allocated_bytes = NUM_PERF_COUNTERS + 1;
+
+    // read the counters of the calling thread that are being recorded
+    void read_counters (bool hardware, Counters& counters)
+    {
+      counters = Counters();
+      if (hardware) {
+        PerfCounters::Values values;
+        PerfCounters::read (values);
+        std::copy (values.begin(), values.end(), counters.begin());
+      }
+      AllocStats::read (counters[allocations], counters[allocated_bytes]);
+    }
+
+    struct Times { NOMEMALIGN
+      double wall, cpu;
+      Counters counters;
+
+      static Times now (bool hardware_counters) {
+        timespec cpu_time;
+        clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &cpu_time);
+        Times t { std::chrono::duration<double> (std::chrono::steady_clock::now().time_since_epoch()).count(),
+                  cpu_time.tv_sec + 1.0e-9 * cpu_time.tv_nsec, Counters() };
+        read_counters (hardware_counters, t.counters);
+        return t;
+      }
+    };
+
+    void add_difference (Counters& total, const Counters& from, const Counters& to)
+    {
+      for (size_t n = 0; n < total.size(); ++n)
+        total[n] += to[n] - from[n];
+    }
+
+    struct PhaseTimes { NOMEMALIGN
+      std::string name;
+      double wall, cpu;
+      size_t calls;
+      std::map<size_t, Counters> counters; // per thread, 0 being the main thread
+
+      Counters total_counters () const {
+        Counters total = Counters();
+        for (const auto& t : counters)
+          for (size_t n = 0; n < total.size(); ++n)
+            total[n] += t.second[n];
+        return total;
+      }
+    };
+
+    struct State { NOMEMALIGN
+      State () : enabled (false), print (false), counting (false) { }
+      bool enabled, print, counting; // counting: whether the hardware performance counters are being recorded
+      std::string path;
+      Times start;
+      vector<PhaseTimes> phases;
+      vector<std::pair<size_t, Times>> active; // index into phases, and time at which it was last resumed
+      vector<vector<std::pair<std::string, double>>> iterations;
+      std::mutex mutex; // guards phases against updates from worker threads
+    };
+
+    State& state ()
+    {
+      static State s;
+      return s;
+    }
+
+    // accumulate the time elapsed since the innermost active phase was last resumed
+    void accumulate (State& s, const Times& now)
+    {
+      if (s.active.empty())
+        return;
+      std::lock_guard<std::mutex> lock (s.mutex);
+      auto& phase = s.phases[s.active.back().first];
+      phase.wall += now.wall - s.active.back().second.wall;
+      phase.cpu += now.cpu - s.active.back().second.cpu;
+      if (s.counting || AllocStats::enabled())
+        add_difference (phase.counters[0], s.active.back().second.counters, now.counters);
+      s.active.back().second = now;
+    }
+
+  }
+
+
+
+  Timings::Phase::Phase (const std::string& name) :
+    active (state().enabled),
+    span (name)
+  {
+    if (!active)
+      return;
+    State& s (state());
+    const Times now = Times::now (s.counting);
+    accumulate (s, now);
+    std::lock_guard<std::mutex> lock (s.mutex);
+    size_t index = 0;
+    while (index < s.phases.size() && s.phases[index].name != name)
+      ++index;
+    if (index == s.phases.size())
+      s.phases.push_back ({ name, 0.0, 0.0, 0, { } });
+    ++s.phases[index].calls;
+    s.active.push_back ({ index, now });
+  }
+
+
+
+  Timings::Phase::~Phase ()
+  {
+    if (!active)
+      return;
+    State& s (state());
+    const Times now = Times::now (s.counting);
+    accumulate (s, now);
+    s.active.pop_back();
+    if (s.active.size())
+      s.active.back().second = now;
+  }
+
+
+
+  Timings::Job::Job (const std::string& phase, size_t thread) :
+    phase (counting() ? phase : std::string()),
+    thread (thread)
+  {
+    if (this->phase.size())
+      read_counters (state().counting, start);
+  }
+
+
+
+  Timings::Job::~Job ()
+  {
+    if (phase.empty())
+      return;
+    State& s (state());
+    Counters end;
+    read_counters (s.counting, end);
+    std::lock_guard<std::mutex> lock (s.mutex);
+    for (auto& p : s.phases) {
+      if (p.name == phase) {
+        add_difference (p.counters[thread], start, end);
+        return;
+      }
+    }
+  }
+
+
+
+  void Timings::enable (bool print, const std::string& path, bool counters)
+  {
+    State& s (state());
+    s.enabled = true;
+    s.print = print;
+    s.path = path;
+    s.counting = counters;
+    s.start = Times::now (counters);
+    if (counters && !PerfCounters::any_available()) {
+      WARN ("hardware performance counters unavailable (check the kernel.perf_event_paranoid setting); reporting timings only");
+      s.counting = false;
+    }
+  }
+
+  bool Timings::enabled ()
+  {
+    return state().enabled;
+  }
+
+  bool Timings::counting ()
+  {
+    return state().enabled && (state().counting || AllocStats::enabled());
+  }
+
+  std::string Timings::current ()
+  {
+    const State& s (state());
+    return s.active.empty() ? std::string() : s.phases[s.active.back().first].name;
+  }
+
+
+
+  void Timings::iteration (const vector<std::pair<std::string, double>>& values)
+  {
+    if (state().enabled)
+      state().iterations.push_back (values);
+  }
+
+
+
+  void Timings::report ()
+  {
+    const State& s (state());
+    if (!s.enabled)
+      return;
+    const Times now = Times::now (false);
+    // peak resident set size of the process (reported in kB on Linux)
+    rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+    const size_t peak_rss = size_t (usage.ru_maxrss) << 10;
+
+    if (s.print) {
+      // counts are summed over all threads, and shown in millions (in columns wide enough for their headers)
+      auto counter_width = [] (size_t n) { return std::max (12, int (strlen (PerfCounters::name (n))) + 4); };
+      auto counter_columns = [&] (const Counters& c) {
+        std::string line;
+        if (s.counting) {
+          line = PerfCounters::available (0) && PerfCounters::available (1) && c[0] ?
+            printf (" %6.2f", double (c[1]) / double (c[0])) : printf (" %6s", "n/a");
+          for (size_t n = 0; n < NUM_PERF_COUNTERS; ++n)
+            line += PerfCounters::available (n) ? printf (" %*.1f", counter_width (n), 1.0e-6 * c[n]) : printf (" %*s", counter_width (n), "n/a");
+        }
+        if (AllocStats::enabled())
+          line += printf (" %12.3f %12.1f", 1.0e-6 * c[allocations], 1.0e-6 * c[allocated_bytes]);
+        return line;
+      };
+      std::string header = printf ("%-24s %12s %12s %8s", "phase", "wall (s)", "CPU (s)", "calls");
+      if (s.counting) {
+        header += printf (" %6s", "IPC");
+        for (size_t n = 0; n < NUM_PERF_COUNTERS; ++n)
+          header += printf (" %*s", counter_width (n), (std::string (PerfCounters::name (n)) + " (M)").c_str());
+      }
+      if (AllocStats::enabled())
+        header += printf (" %12s %12s", "allocs (M)", "alloc (MB)");
+      CONSOLE (header);
+      Counters total = Counters();
+      for (const auto& phase : s.phases) {
+        const Counters c = phase.total_counters();
+        for (size_t n = 0; n < total.size(); ++n)
+          total[n] += c[n];
+        CONSOLE (printf ("%-24s %12.3f %12.3f %8zu", phase.name.c_str(), phase.wall, phase.cpu, phase.calls) + counter_columns (c));
+      }
+      CONSOLE (printf ("%-24s %12.3f %12.3f %8s", "total", now.wall - s.start.wall, now.cpu - s.start.cpu, "") + counter_columns (total));
+      CONSOLE (printf ("peak resident memory: %.1f MB", peak_rss / double (1 << 20)));
+      for (size_t i = 0; i < s.iterations.size(); ++i) {
+        std::string line = "iteration " + str(i+1) + ":";
+        for (const auto& value : s.iterations[i])
+          line += " " + value.first + " " + str(value.second);
+        CONSOLE (line);
+      }
+    }
+
+    // allocations within hot regions are always reported, as they indicate a regression
+    const auto hot_regions = AllocStats::hot_regions();
+    for (const auto& region : hot_regions)
+      if (region.count)
+        WARN (str(region.count) + " allocations (" + str(region.bytes) + " bytes) within hot region \"" + region.name + "\"");
+
+    if (s.path.size()) {
+      File::OFStream out (s.path);
+      out.precision (9);
+      auto write_counters = [&] (const Counters& c) {
+        if (s.counting)
+          for (size_t n = 0; n < NUM_PERF_COUNTERS; ++n)
+            if (PerfCounters::available (n))
+              out << ", \"" << PerfCounters::name (n) << "\": " << c[n];
+        if (AllocStats::enabled())
+          out << ", \"allocations\": " << c[allocations] << ", \"allocated bytes\": " << c[allocated_bytes];
+      };
+      out << "{\n  \"phases\": [";
+      for (size_t n = 0; n < s.phases.size(); ++n) {
+        out << (n ? ",\n" : "\n") << "    { \"name\": \"" << s.phases[n].name << "\", \"wall\": " << s.phases[n].wall
+            << ", \"cpu\": " << s.phases[n].cpu << ", \"calls\": " << s.phases[n].calls;
+        if (s.counting || AllocStats::enabled()) {
+          write_counters (s.phases[n].total_counters());
+          out << ", \"threads\": [";
+          bool first = true;
+          for (const auto& t : s.phases[n].counters) {
+            out << (first ? " " : ", ") << "{ \"thread\": " << t.first;
+            write_counters (t.second);
+            out << " }";
+            first = false;
+          }
+          out << " ]";
+        }
+        out << " }";
+      }
+      out << "\n  ],\n  \"total\": { \"wall\": " << now.wall - s.start.wall << ", \"cpu\": " << now.cpu - s.start.cpu << ", \"peak_rss\": " << peak_rss << " },\n";
+      out << "  \"iterations\": [";
+      for (size_t i = 0; i < s.iterations.size(); ++i) {
+        out << (i ? ",\n" : "\n") << "    {";
+        for (size_t v = 0; v < s.iterations[i].size(); ++v)
+          out << (v ? ", " : " ") << "\"" << s.iterations[i][v].first << "\": " << s.iterations[i][v].second;
+        out << " }";
+      }
+      out << "\n  ]";
+      if (AllocStats::enabled()) {
+        out << ",\n  \"hot_regions\": [";
+        for (size_t n = 0; n < hot_regions.size(); ++n)
+          out << (n ? ",\n" : "\n") << "    { \"name\": \"" << hot_regions[n].name << "\", \"allocations\": " << hot_regions[n].count
+              << ", \"allocated bytes\": " << hot_regions[n].bytes << " }";
+        out << "\n  ]";
+      }
+      out << "\n}\n";
+    }
+  }
+
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __timings_h__
+#define __timings_h__
+
+#include "mrtrix.h"
+#include "alloc_stats.h"
+#include "perf_counters.h"
+#include "trace.h"
+
+namespace MR
+{
+
+  //! Record the wall-clock and CPU time spent in the phases of a command
+  /*! Each phase is delimited by the lifetime of a Timings::Phase object, created
+   * in the main thread; a phase may be entered several times (e.g. once per
+   * iteration), and its times are accumulated. Phases may be nested, in which
+   * case the time spent in the inner phase is attributed to that phase only.
+   *
+   * CPU time is that of the whole process (i.e. summed over all threads), so
+   * that the ratio of CPU to wall-clock time of a phase shows how well it is
+   * parallelised.
+   *
+   * Statistics for each iteration of a command (e.g. convergence details) can
+   * also be recorded, and are reported along with the phase timings.
+   *
+   * Optionally, the hardware performance counters of each thread (see
+   * PerfCounters) are also recorded for each phase: those of the main thread
+   * by the Phase objects themselves, and those of the worker threads by Job
+   * objects, which attribute the events of a parallel job to the phase in
+   * which it was started. Counts are reported summed over all threads, and
+   * also per thread in the file. The same applies to the number of heap
+   * allocations and bytes allocated, in builds that count them (see
+   * AllocStats); any allocation made within a hot region is also reported.
+   *
+   * Recording is disabled by default, in which case Phase objects have no
+   * effect and report() does nothing. Independently of this, each phase is
+   * also recorded as a span of the trace, if tracing is enabled (see Trace). */
+  class Timings { NOMEMALIGN
+    public:
+      //! the hardware performance counters, followed by the number of allocations and of bytes allocated
+      using Counters = std::array<uint64_t, NUM_PERF_COUNTERS + 2>;
+
+      class Phase { NOMEMALIGN
+        public:
+          Phase (const std::string& name);
+          ~Phase ();
+        protected:
+          const bool active;
+          Trace::Span span;
+      };
+
+      //! attribute the counter events (and allocations) of a worker thread during its lifetime to the named phase
+      class Job { NOMEMALIGN
+        public:
+          Job (const std::string& phase, size_t thread);
+          ~Job ();
+        protected:
+          const std::string phase;
+          const size_t thread;
+          Counters start;
+      };
+
+      //! start recording, to be printed at report() and/or written to the given file (if not empty)
+      /*! If \a counters is set, the hardware performance counters are also
+       * recorded, if available; otherwise a warning is issued and only the
+       * timings are recorded. */
+      static void enable (bool print, const std::string& path = std::string(), bool counters = false);
+      static bool enabled ();
+      //! whether hardware performance counters or allocations are being recorded for each phase
+      static bool counting ();
+      //! the name of the innermost phase currently entered in the main thread (empty if none)
+      static std::string current ();
+
+      //! record a set of named values for the next iteration of the command
+      static void iteration (const vector<std::pair<std::string, double>>& values);
+
+      //! print and/or write the timings recorded since enable(), as requested
+      /*! The file is written in JSON format, holding the list of phases (in the
+       * order first entered), the total times since recording started (along
+       * with the peak resident memory of the process), and the list of
+       * iterations. */
+      static void report ();
+  };
+
+}
+
+#endif
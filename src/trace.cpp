@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+
+#include "file/ofstream.h"
+
+namespace MR
+{
+
+  namespace
+  {
+
+    struct Event { NOMEMALIGN
+      std::string name;
+      double start, duration; // in microseconds since recording started
+    };
+
+    // the events recorded by one thread, and its stack of active spans
+    struct Buffer { NOMEMALIGN
+      size_t tid;
+      vector<Event> events;
+      vector<std::string> active;
+    };
+
+    struct State { NOMEMALIGN
+      State () : enabled (false) { }
+      ~State () {
+        try {
+          write();
+        }
+        catch (Exception& e) {
+          e.display();
+        }
+      }
+
+      void write ();
+
+      std::atomic<bool> enabled;
+      std::string path;
+      std::chrono::steady_clock::time_point origin;
+      std::mutex mutex;
+      vector<std::unique_ptr<Buffer>> buffers;
+    };
+
+    State& state ()
+    {
+      static State s;
+      return s;
+    }
+
+    double now ()
+    {
+      return std::chrono::duration<double, std::micro> (std::chrono::steady_clock::now() - state().origin).count();
+    }
+
+    // the buffer of the calling thread, registered on first use
+    // (buffers are owned by the state, so that they outlive their threads)
+    Buffer& buffer ()
+    {
+      thread_local Buffer* b = nullptr;
+      if (!b) {
+        State& s (state());
+        std::lock_guard<std::mutex> lock (s.mutex);
+        s.buffers.push_back (std::unique_ptr<Buffer> (new Buffer));
+        b = s.buffers.back().get();
+        b->tid = s.buffers.size() - 1;
+      }
+      return *b;
+    }
+
+    std::string escape (const std::string& s)
+    {
+      std::string escaped;
+      for (auto c : s) {
+        if (c == '"' || c == '\\')
+          escaped += '\\';
+        escaped += c;
+      }
+      return escaped;
+    }
+
+    void State::write ()
+    {
+      if (!enabled || path.empty())
+        return;
+      std::lock_guard<std::mutex> lock (mutex);
+      File::OFStream out (path);
+      out.precision (3);
+      out << std::fixed << "[";
+      bool first = true;
+      for (const auto& b : buffers) {
+        out << (first ? "\n" : ",\n") << "{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << b->tid
+            << ", \"args\": { \"name\": \"" << (b->tid ? "thread " + str(b->tid) : std::string ("main")) << "\" } }";
+        first = false;
+        for (const auto& e : b->events)
+          out << ",\n{ \"name\": \"" << escape (e.name) << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << b->tid
+              << ", \"ts\": " << e.start << ", \"dur\": " << e.duration << " }";
+      }
+      out << "\n]\n";
+    }
+
+  }
+
+
+
+  Trace::Span::Span (const std::string& name) :
+    active (state().enabled),
+    start (0.0)
+  {
+    if (!active)
+      return;
+    buffer().active.push_back (name);
+    start = now();
+  }
+
+
+
+  Trace::Span::~Span ()
+  {
+    if (!active)
+      return;
+    Buffer& b (buffer());
+    b.events.push_back ({ std::move (b.active.back()), start, now() - start });
+    b.active.pop_back();
+  }
+
+
+
+  void Trace::enable (const std::string& path)
+  {
+    State& s (state());
+    s.path = path;
+    s.origin = std::chrono::steady_clock::now();
+    // register the calling (main) thread first, as thread 0
+    buffer();
+    s.enabled = true;
+  }
+
+  bool Trace::enabled ()
+  {
+    return state().enabled;
+  }
+
+  std::string Trace::current ()
+  {
+    if (!state().enabled)
+      return std::string();
+    const Buffer& b (buffer());
+    return b.active.size() ? b.active.back() : std::string();
+  }
+
+  void Trace::write ()
+  {
+    state().write();
+  }
+
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2008-2018 the MRtrix3 contributors.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see http://www.mrtrix.org/
+ */
+
+
+#ifndef __trace_h__
+#define __trace_h__
+
+#include "mrtrix.h"
+
+namespace MR
+{
+
+  //! Record a timeline of the work performed by each thread, in Chrome trace-event format
+  /*! Each span of work is delimited by the lifetime of a Trace::Span object,
+   * and is appended to a buffer held by the thread that created it, without
+   * any synchronisation between threads. The buffers of all threads are
+   * written to file at exit (or when write() is called), as a JSON array of
+   * complete ('X') events, which can be loaded in chrome://tracing or any
+   * compatible viewer (e.g. Perfetto).
+   *
+   * Spans may be nested within a thread. The name of the innermost span of
+   * the calling thread is available through current(), so that the spans of
+   * work dispatched to other threads can be named after it.
+   *
+   * Recording is disabled by default, in which case Span objects have no
+   * effect. */
+  class Trace { NOMEMALIGN
+    public:
+      class Span { NOMEMALIGN
+        public:
+          Span (const std::string& name);
+          ~Span ();
+        protected:
+          const bool active;
+          double start;
+      };
+
+      //! start recording, to be written to the given file
+      static void enable (const std::string& path);
+      static bool enabled ();
+
+      //! the name of the innermost span of the calling thread (empty if none)
+      static std::string current ();
+
+      //! write the events recorded so far by all threads (also done automatically at exit)
+      static void write ();
+  };
+
+}
+
+#endif